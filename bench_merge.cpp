@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "iterator.h"
+
+/* Compares merge_iter (binary heap) against loser_tree_iter on in-memory
+ * runs, the same total number of entries split over different fan-ins. */
+
+/* The k-way merge on a binary heap that loser_tree_iter replaced, kept here
+ * as the baseline. */
+template <typename Iter> class merge_iter {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = typename Iter::value_type;
+  using difference_type = ptrdiff_t;
+  using pointer = value_type *;
+  using reference = value_type &;
+
+  template <typename Iters>
+  merge_iter(Iters begin, Iters end) : _iters(begin, end), _heap(end - begin) {
+    for (auto &iter : _iters) {
+      if (iter.valid()) {
+        _heap.add(&iter);
+      }
+    }
+  }
+
+  merge_iter &operator++() {
+    auto first = _heap.poll();
+    first.iter->operator++();
+    if (first.iter->valid()) {
+      _heap.add(first);
+    }
+    return *this;
+  }
+
+  value_type operator*() { return _heap.front().iter->operator*(); }
+
+  const value_type *operator->() { return _heap.front().iter->operator->(); }
+
+  bool valid() { return !_heap.empty(); }
+
+private:
+  struct iter_p {
+    Iter *iter;
+    iter_p(Iter *i) : iter(i) {}
+    /* The heap keeps the largest on top, so the order is reversed. */
+    bool operator<(const iter_p &rhs) {
+      return key_less(*(*rhs.iter).operator->(), *(*iter).operator->());
+    }
+  };
+  heap<iter_p> _heap;
+  std::vector<Iter> _iters;
+};
+
+using run_t = std::vector<entry<slice_url_t>>;
+
+struct run_iter {
+  using iterator_category = std::input_iterator_tag;
+  using value_type = entry<slice_url_t>;
+  using difference_type = ptrdiff_t;
+  using pointer = value_type *;
+  using reference = value_type &;
+
+  const value_type *cur, *end;
+
+  run_iter(const run_t &run) : cur(run.data()), end(run.data() + run.size()) {}
+
+  value_type operator*() { return *cur; }
+  const value_type *operator->() { return cur; }
+  run_iter &operator++() {
+    ++cur;
+    return *this;
+  }
+  bool valid() { return cur != end; }
+};
+
+template <typename Merge> double drain(std::vector<run_iter> iters) {
+  auto start = std::chrono::steady_clock::now();
+  Merge miter(iters.begin(), iters.end());
+  count_t total = 0;
+  for (; miter.valid(); ++miter) {
+    total += miter->count;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  // Keep the loop from being optimized away.
+  if (total == 0) {
+    fprintf(stderr, "nothing merged\n");
+  }
+  return elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  size_t n_entries = argc > 1 ? atol(argv[1]) : 1 << 20;
+  std::mt19937_64 rng(42);
+  std::hash<slice_url_t> hasher;
+  std::vector<std::string> keys(n_entries);
+  for (auto &key : keys) {
+    key = "http://www.example.com/" + std::to_string(rng() % (n_entries * 4));
+  }
+  printf("%8s %12s %12s %8s\n", "fan-in", "heap (s)", "loser (s)", "speedup");
+  for (size_t k = 8; k <= 1024; k *= 2) {
+    std::vector<run_t> runs(k);
+    for (size_t i = 0; i < n_entries; i++) {
+      runs[i % k].push_back({slice_url_t(keys[i]), 1, hasher(keys[i])});
+    }
+    std::vector<run_iter> iters;
+    for (auto &run : runs) {
+      std::sort(run.begin(), run.end(), key_less<entry<slice_url_t>>);
+      iters.emplace_back(run);
+    }
+    double heap_time = drain<merge_iter<run_iter>>(iters);
+    double loser_time = drain<loser_tree_iter<run_iter>>(iters);
+    printf("%8zu %12.4f %12.4f %7.2fx\n", k, heap_time, loser_time,
+           heap_time / loser_time);
+  }
+}
@@ -0,0 +1,258 @@
+#include <algorithm>
+
+#include <string.h>
+
+#ifdef TOP100_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TOP100_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "codec.h"
+
+namespace {
+
+class none_codec : public codec {
+public:
+  uint32_t id() const override { return 0; }
+
+  const char *name() const override { return "none"; }
+
+  void compress(const char *src, size_t n, std::string &out) const override {
+    out.append(src, n);
+  }
+
+  bool decompress(const char *src, size_t n, char *dst,
+                  size_t raw_size) const override {
+    if (n != raw_size) {
+      return false;
+    }
+    memcpy(dst, src, n);
+    return true;
+  }
+};
+
+/* LZ77 in the format of LZ4 blocks: a sequence is a token (literal length in
+ * the high nibble, match length - 4 in the low one, 15 goes on in bytes of
+ * 255), the literals, and a 2 byte offset back to the match. The last
+ * sequence has literals only. Matches are found through a table of the last
+ * position of every hashed 4 bytes, which is all the search there is: it is
+ * meant to keep up with the disk, not to get the best ratio. */
+class lz_codec : public codec {
+public:
+  uint32_t id() const override { return 1; }
+
+  const char *name() const override { return "lz"; }
+
+  void compress(const char *src, size_t n, std::string &out) const override {
+    uint32_t table[1 << hash_bits] = {0};
+    size_t anchor = 0, i = 0;
+    while (i + min_match <= n) {
+      uint32_t seq = load32(src + i);
+      uint32_t h = (seq * 2654435761u) >> (32 - hash_bits);
+      size_t candidate = table[h];
+      table[h] = i;
+      if (candidate >= i || i - candidate > max_offset ||
+          load32(src + candidate) != seq) {
+        i++;
+        continue;
+      }
+      size_t len = min_match;
+      while (i + len < n && src[candidate + len] == src[i + len]) {
+        len++;
+      }
+      put_sequence(out, src + anchor, i - anchor, i - candidate, len);
+      i += len;
+      anchor = i;
+    }
+    put_sequence(out, src + anchor, n - anchor, 0, 0);
+  }
+
+  bool decompress(const char *src, size_t n, char *dst,
+                  size_t raw_size) const override {
+    const char *end = src + n;
+    size_t pos = 0;
+    while (src < end) {
+      unsigned token = (unsigned char)*src++;
+      size_t literals = token >> 4;
+      if (!get_length(src, end, literals) ||
+          literals > (size_t)(end - src) || literals > raw_size - pos) {
+        return false;
+      }
+      memcpy(dst + pos, src, literals);
+      src += literals;
+      pos += literals;
+      if (src == end) {
+        break;
+      }
+      if (end - src < 2) {
+        return false;
+      }
+      size_t offset = (unsigned char)src[0] | (unsigned char)src[1] << 8;
+      src += 2;
+      size_t len = token & 15;
+      if (!get_length(src, end, len)) {
+        return false;
+      }
+      len += min_match;
+      if (offset == 0 || offset > pos || len > raw_size - pos) {
+        return false;
+      }
+      // The match may overlap what it writes, byte by byte then.
+      for (size_t k = 0; k < len; k++, pos++) {
+        dst[pos] = dst[pos - offset];
+      }
+    }
+    return pos == raw_size;
+  }
+
+private:
+  static constexpr int hash_bits = 12;
+  static constexpr size_t min_match = 4;
+  static constexpr size_t max_offset = 65535;
+
+  static uint32_t load32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static void put_length(std::string &out, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+      out.push_back((char)255);
+    }
+    out.push_back((char)len);
+  }
+
+  /* Adds the bytes that go on from a nibble of 15 to len */
+  static bool get_length(const char *&p, const char *end, size_t &len) {
+    if (len != 15) {
+      return true;
+    }
+    while (p < end) {
+      unsigned byte = (unsigned char)*p++;
+      len += byte;
+      if (byte != 255) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* A match_len of 0 makes the last sequence, literals only */
+  static void put_sequence(std::string &out, const char *literals,
+                           size_t n_literals, size_t offset,
+                           size_t match_len) {
+    size_t match = match_len ? match_len - min_match : 0;
+    out.push_back((char)(std::min(n_literals, (size_t)15) << 4 |
+                         std::min(match, (size_t)15)));
+    if (n_literals >= 15) {
+      put_length(out, n_literals);
+    }
+    out.append(literals, n_literals);
+    if (match_len == 0) {
+      return;
+    }
+    out.push_back((char)(offset & 0xff));
+    out.push_back((char)(offset >> 8));
+    if (match >= 15) {
+      put_length(out, match);
+    }
+  }
+};
+
+#ifdef TOP100_HAVE_ZSTD
+class zstd_codec : public codec {
+public:
+  uint32_t id() const override { return 2; }
+
+  const char *name() const override { return "zstd"; }
+
+  void compress(const char *src, size_t n, std::string &out) const override {
+    size_t offset = out.size();
+    out.resize(offset + ZSTD_compressBound(n));
+    // The fastest regular level, flushes and merges are on the hot path.
+    size_t size = ZSTD_compress(&out[offset], out.size() - offset, src, n, 1);
+    out.resize(offset + (ZSTD_isError(size) ? 0 : size));
+  }
+
+  bool decompress(const char *src, size_t n, char *dst,
+                  size_t raw_size) const override {
+    size_t size = ZSTD_decompress(dst, raw_size, src, n);
+    return !ZSTD_isError(size) && size == raw_size;
+  }
+};
+#endif
+
+#ifdef TOP100_HAVE_LZ4
+class lz4_codec : public codec {
+public:
+  uint32_t id() const override { return 3; }
+
+  const char *name() const override { return "lz4"; }
+
+  void compress(const char *src, size_t n, std::string &out) const override {
+    size_t offset = out.size();
+    out.resize(offset + LZ4_compressBound(n));
+    int size = LZ4_compress_default(src, &out[offset], n, out.size() - offset);
+    out.resize(offset + size);
+  }
+
+  bool decompress(const char *src, size_t n, char *dst,
+                  size_t raw_size) const override {
+    return LZ4_decompress_safe(src, dst, n, raw_size) == (int)raw_size;
+  }
+};
+#endif
+
+const none_codec none_instance;
+const lz_codec lz_instance;
+#ifdef TOP100_HAVE_ZSTD
+const zstd_codec zstd_instance;
+#endif
+#ifdef TOP100_HAVE_LZ4
+const lz4_codec lz4_instance;
+#endif
+
+const codec *const codecs[] = {
+    &none_instance,
+    &lz_instance,
+#ifdef TOP100_HAVE_ZSTD
+    &zstd_instance,
+#endif
+#ifdef TOP100_HAVE_LZ4
+    &lz4_instance,
+#endif
+};
+
+} // namespace
+
+const codec *codec::none() { return &none_instance; }
+
+const codec *codec::find(uint32_t id) {
+  for (const codec *c : codecs) {
+    if (c->id() == id) {
+      return c;
+    }
+  }
+  return nullptr;
+}
+
+const codec *codec::find(std::string_view name) {
+  for (const codec *c : codecs) {
+    if (name == c->name()) {
+      return c;
+    }
+  }
+  return nullptr;
+}
+
+std::string codec::names() {
+  std::string names;
+  for (const codec *c : codecs) {
+    names += names.empty() ? "" : ", ";
+    names += c->name();
+  }
+  return names;
+}
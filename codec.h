@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compresses the blocks of the SST files. The id of the codec is stored in
+ * the header of a file, so a reader finds it there whatever the writer was
+ * told. "none" and the built-in "lz" are always there, "zstd" and "lz4" when
+ * their libraries were found by cmake. */
+class codec {
+public:
+  virtual ~codec() = default;
+
+  virtual uint32_t id() const = 0;
+
+  virtual const char *name() const = 0;
+
+  /* Appends [src, src + n) compressed to out */
+  virtual void compress(const char *src, size_t n, std::string &out) const = 0;
+
+  /* Decompresses [src, src + n) into dst, which takes exactly raw_size bytes.
+   * Returns false if the input is corrupted. */
+  virtual bool decompress(const char *src, size_t n, char *dst,
+                          size_t raw_size) const = 0;
+
+  /* Stores blocks as they are */
+  static const codec *none();
+
+  /* nullptr if this build does not have it */
+  static const codec *find(uint32_t id);
+  static const codec *find(std::string_view name);
+
+  /* The names of the codecs of this build, for the usage */
+  static std::string names();
+};
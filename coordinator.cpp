@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <map>
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "coordinator.h"
+#include "iterator.h"
+#include "master.h"
+#include "sst.h"
+#include "task_pool.h"
+
+void die(const char *fmt, ...);
+
+static std::string absolute_path(const std::string &path) {
+  char buf[PATH_MAX];
+  if (!realpath(path.c_str(), buf)) {
+    die("Cannot resolve %s: %s\n", path.c_str(), strerror(errno));
+  }
+  return buf;
+}
+
+coordinator::coordinator(options opts)
+    : _opts(std::move(opts)), _result(std::max(_opts.top_k, (size_t)1)) {
+  mkdir(_opts.spool.c_str(), 0700);
+  // The workers change their directory.
+  _opts.spool = absolute_path(_opts.spool);
+  for (auto &input : _opts.inputs) {
+    input = absolute_path(input);
+  }
+  for (auto &dir : _opts.spill_dirs) {
+    mkdir(dir.c_str(), 0700);
+    dir = absolute_path(dir);
+  }
+}
+
+void coordinator::run_worker(size_t index, size_t n_workers) {
+  std::vector<std::string> spill_dirs;
+  for (const auto &dir : _opts.spill_dirs) {
+    spill_dirs.push_back(dir + "/worker-" + std::to_string(index));
+  }
+  for (size_t i = 0; i < _opts.inputs.size(); i++) {
+    struct stat st;
+    if (stat(_opts.inputs[i].c_str(), &st) != 0) {
+      die("Cannot stat the input file: %s\n", _opts.inputs[i].c_str());
+    }
+    size_t size = st.st_size;
+    master m(_opts.inputs[i], _opts.n_shards, _opts.mem_high_water_mark,
+             _opts.top_k, _opts.n_threads);
+    m.restrict_input(size / n_workers * index,
+                     index + 1 == n_workers ? size
+                                            : size / n_workers * (index + 1));
+    m.compress_runs(_opts.compression);
+    m.spill_to(spill_dirs);
+    m.export_runs(_opts.spool + "/run-" + std::to_string(index) + "-" +
+                  std::to_string(i) + "-");
+    m.start();
+    m.wait_for_all_workers();
+  }
+  for (const auto &dir : spill_dirs) {
+    rmdir(dir.c_str());
+  }
+}
+
+void coordinator::fork_workers(size_t n_workers) {
+  std::vector<pid_t> pids;
+  for (size_t i = 0; i < n_workers; i++) {
+    std::string dir = _opts.spool + "/worker-" + std::to_string(i);
+    mkdir(dir.c_str(), 0700);
+    fflush(nullptr);
+    pid_t pid = fork();
+    if (pid < 0) {
+      die("Cannot fork worker %zu: %s\n", i, strerror(errno));
+    }
+    if (pid == 0) {
+      // The spill directories of every worker are apart.
+      if (chdir(dir.c_str()) != 0) {
+        die("Cannot enter %s: %s\n", dir.c_str(), strerror(errno));
+      }
+      run_worker(i, n_workers);
+      _exit(EXIT_SUCCESS);
+    }
+    pids.push_back(pid);
+  }
+  bool failed = false;
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) {
+      fprintf(stderr, "Worker %zu failed\n", i);
+      failed = true;
+    }
+    rmdir((_opts.spool + "/worker-" + std::to_string(i)).c_str());
+  }
+  if (failed) {
+    die("Not all the workers are done, the spool is left as it is\n");
+  }
+}
+
+std::vector<coordinator::export_run> coordinator::list_exports() const {
+  std::vector<export_run> runs;
+  DIR *dir = opendir(_opts.spool.c_str());
+  if (!dir) {
+    die("Cannot open the spool: %s\n", _opts.spool.c_str());
+  }
+  while (dirent *e = readdir(dir)) {
+    size_t worker, input, shard, n_shards;
+    int n = 0;
+    if (sscanf(e->d_name, "run-%zu-%zu-shard-%zu-of-%zu.sst%n", &worker,
+               &input, &shard, &n_shards, &n) == 4 &&
+        e->d_name[n] == '\0') {
+      runs.push_back({_opts.spool + "/" + e->d_name, shard, n_shards});
+    }
+  }
+  closedir(dir);
+  return runs;
+}
+
+void coordinator::reduce() {
+  auto runs = list_exports();
+  std::map<size_t, std::vector<std::string>> shards;
+  for (const auto &run : runs) {
+    // Shards of a different split would not hold disjoint urls.
+    if (run.n_shards != runs.front().n_shards) {
+      die("The spool %s mixes %zu and %zu shards\n", _opts.spool.c_str(),
+          run.n_shards, runs.front().n_shards);
+    }
+    shards[run.shard].push_back(run.path);
+  }
+  std::vector<const std::vector<std::string> *> work;
+  for (const auto &shard : shards) {
+    work.push_back(&shard.second);
+  }
+  task_pool pool(std::min(_opts.n_threads, std::max(work.size(), (size_t)1)));
+  task_group group(pool);
+  for (const auto *paths : work) {
+    group.submit([this, paths] { reduce_shard(*paths); });
+  }
+  group.wait();
+  for (const auto &run : runs) {
+    unlink(run.path.c_str());
+  }
+  // Only goes if nothing else is in there.
+  rmdir(_opts.spool.c_str());
+}
+
+void coordinator::reduce_shard(const std::vector<std::string> &paths) {
+  std::vector<sst_read_iter> iters;
+  for (const auto &path : paths) {
+    FILE *input = fopen(path.c_str(), "rb");
+    if (!input) {
+      die("Cannot open the exported sst: %s\n", path.c_str());
+    }
+    iters.emplace_back(input);
+  }
+  // Every worker counted a url once per shard, the runs only need adding up.
+  heap_type private_heap(std::max(_opts.top_k, (size_t)1));
+  key_aggregator aggregator([&](slice_url_t url, count_t count, size_t) {
+    private_heap.add(url, count);
+  });
+  for (loser_tree_iter<sst_read_iter> miter(iters.begin(), iters.end());
+       miter.valid(); ++miter) {
+    aggregator.add(*miter.operator->());
+  }
+  aggregator.finish();
+  for (auto &iter : iters) {
+    iter.close();
+  }
+  std::lock_guard<std::mutex> lk(_result_mtx);
+  for (auto &&e : private_heap) {
+    _result.add(std::move(e.url), e.count);
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+
+#include "codec.h"
+#include "entry.h"
+#include "heap.h"
+#include "types.h"
+
+/* Partitioned execution over several processes, on one host or on several
+ * hosts that share the spool directory. Worker i of n counts the lines that
+ * start in the i-th n-th of every input, as a master of its own, and exports
+ * all the counts of every shard to the spool. A url always lands in the same
+ * shard, so the coordinator gets the exact counts by merging the exports of
+ * each shard, one shard at a time. */
+class coordinator {
+public:
+  using heap_type = heap<entry<owned_url_t, false>>;
+
+  struct options {
+    std::vector<std::string> inputs;
+    std::string spool = "top100-spool";
+    size_t n_shards = 1;
+    /* For each worker */
+    size_t mem_high_water_mark = 0;
+    size_t n_threads = 1;
+    size_t top_k = 100;
+    /* Of the exports */
+    const codec *compression = codec::none();
+    /* Where the workers spill, each in a worker-<i> of its own in all of
+     * them; the directory of the worker if there is none. */
+    std::vector<std::string> spill_dirs;
+  };
+
+  coordinator(options opts);
+
+  /* Runs worker index of n_workers in this process. */
+  void run_worker(size_t index, size_t n_workers);
+
+  /* Forks n_workers workers, each in a directory of its own under the spool,
+   * and waits for all of them. Dies if one of them fails. */
+  void fork_workers(size_t n_workers);
+
+  /* Merges the exports in the spool into the top k, with n_threads shards at
+   * a time, and removes them. */
+  void reduce();
+
+  heap_type::iterator result_begin() { return _result.begin(); }
+
+  heap_type::iterator result_end() { return _result.end(); }
+
+private:
+  /* An exported sst: which shard, out of how many */
+  struct export_run {
+    std::string path;
+    size_t shard;
+    size_t n_shards;
+  };
+
+  std::vector<export_run> list_exports() const;
+  void reduce_shard(const std::vector<std::string> &paths);
+
+  options _opts;
+  std::mutex _result_mtx;
+  heap_type _result;
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* Count-Min sketch (Cormode and Muthukrishnan) over url hashes. The estimate
+ * of a url is never below its true count. Updates are conservative: only the
+ * cells that hold the current minimum grow, which keeps the over-estimate
+ * smaller without breaking that bound. */
+class count_min_sketch {
+public:
+  static constexpr size_t depth = 4;
+
+  /* width is rounded up to a power of two */
+  count_min_sketch(size_t width)
+      : _width(std::max(round_up(width), (size_t)1)),
+        _cells(std::make_unique<count_t[]>(_width * depth)) {}
+
+  void add(size_t hash, count_t weight = 1) {
+    size_t cells[depth];
+    locate(hash, cells);
+    count_t target = estimate(cells) + weight;
+    for (size_t i = 0; i < depth; i++) {
+      _cells[cells[i]] = std::max(_cells[cells[i]], target);
+    }
+  }
+
+  count_t estimate(size_t hash) const {
+    size_t cells[depth];
+    locate(hash, cells);
+    return estimate(cells);
+  }
+
+  size_t width() const { return _width; }
+
+  size_t mem_usage() const { return _width * depth * sizeof(count_t); }
+
+  /* The widest sketch that fits in budget bytes */
+  static size_t width_for(size_t budget) {
+    size_t width = std::max(budget / (depth * sizeof(count_t)), (size_t)1);
+    // Round down, the constructor rounds up.
+    return (size_t)1 << (63 - __builtin_clzll(width));
+  }
+
+private:
+  static size_t round_up(size_t n) {
+    return n <= 1 ? 1 : (size_t)1 << (64 - __builtin_clzll(n - 1));
+  }
+
+  /* Double hashing on a mixed copy of the hash, the shards already use its
+   * low bits. */
+  void locate(size_t hash, size_t *cells) const {
+    uint64_t h = hash * 0x9E3779B97F4A7C15ull;
+    uint64_t h1 = h >> 32, h2 = (h & 0xffffffff) | 1;
+    for (size_t i = 0; i < depth; i++) {
+      cells[i] = i * _width + ((h1 + i * h2) & (_width - 1));
+    }
+  }
+
+  count_t estimate(const size_t *cells) const {
+    count_t min = _cells[cells[0]];
+    for (size_t i = 1; i < depth; i++) {
+      min = std::min(min, _cells[cells[i]]);
+    }
+    return min;
+  }
+
+  size_t _width;
+  std::unique_ptr<count_t[]> _cells;
+};
@@ -1,30 +1,104 @@
 #pragma once
 #include <type_traits>
+#include <utility>
 
 #include "types.h"
 
 template <typename Url, bool min = true> struct entry {
   Url url;
   count_t count;
+  /* The hash of url, or 0 when nobody hashed it */
+  size_t hash = 0;
 
   entry() = default;
 
   template <typename String>
-  entry(String str, count_t c) : url(str), count(c) {}
+  entry(String str, count_t c, size_t h = 0)
+      : url(std::move(str)), count(c), hash(h) {}
 
-  bool operator<(const entry &rhs) {
+  /* Like constructing it again, but an owned url keeps its buffer. */
+  template <typename String>
+  void assign(String &&str, count_t c, size_t h = 0) {
+    url = std::forward<String>(str);
+    count = c;
+    hash = h;
+  }
+
+  /* The order of operator<, on the counts alone */
+  static bool count_less(count_t lhs, count_t rhs) {
     if constexpr (min) {
-      return count < rhs.count;
+      return lhs < rhs;
     } else {
-      return count > rhs.count;
+      return lhs > rhs;
     }
   }
 
+  bool operator<(const entry &rhs) { return count_less(count, rhs.count); }
+
   bool operator==(const entry &rhs) const {
     return url == rhs.url && count == rhs.count;
   }
 };
 
+/* An entry whose count over-estimates the true count by at most error */
+template <typename Url, bool min = true>
+struct approx_entry : entry<Url, min> {
+  count_t error = 0;
+
+  approx_entry() = default;
+
+  template <typename String>
+  approx_entry(String str, count_t c, count_t e = 0)
+      : entry<Url, min>(std::move(str), c), error(e) {}
+
+  template <typename String>
+  void assign(String &&str, count_t c, count_t e = 0) {
+    entry<Url, min>::assign(std::forward<String>(str), c);
+    error = e;
+  }
+};
+
+/* The order of memtables and SST runs: by hash, and by url when the hashes
+ * collide. Merges mostly compare integers that way. */
+template <typename Entry> bool key_less(const Entry &lhs, const Entry &rhs) {
+  return lhs.hash != rhs.hash ? lhs.hash < rhs.hash : lhs.url < rhs.url;
+}
+
+/* Adds up the counts of equal keys that come in key_less order, and hands
+ * every key with its total to emit(url, count, hash). The url is only valid
+ * during the call: the key is copied into a buffer that is reused, so once it
+ * fits the longest key no key allocates. */
+template <typename Emit> class key_aggregator {
+public:
+  key_aggregator(Emit emit) : _emit(std::move(emit)) {}
+
+  template <typename Entry> void add(const Entry &e) {
+    // Equal urls have equal hashes, the strings only tell collisions apart.
+    if (_count > 0 && e.hash == _hash && e.url == _url) {
+      _count += e.count;
+      return;
+    }
+    finish();
+    _url.assign(e.url.data(), e.url.size());
+    _count = e.count;
+    _hash = e.hash;
+  }
+
+  /* Emits the last key, call it after the last add. */
+  void finish() {
+    if (_count > 0) {
+      _emit(slice_url_t(_url), _count, _hash);
+      _count = 0;
+    }
+  }
+
+private:
+  Emit _emit;
+  owned_url_t _url;
+  count_t _count = 0;
+  size_t _hash = 0;
+};
+
 template <typename T> struct is_entry : std::false_type {};
 
 template <typename Url, bool m>
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <assert.h>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "types.h"
@@ -21,6 +22,15 @@ public:
     if (_heap.size() < _limit) {
       _heap.emplace_back(std::forward<T>(args)...);
       std::push_heap(_heap.begin(), _heap.end());
+    } else if constexpr (sizeof...(T) >= 2) {
+      // A url and its count: most of them lose to the front, so find out
+      // before the url is copied, and then reuse the buffer of the loser.
+      count_t count = std::get<1>(std::forward_as_tuple(args...));
+      if (Entry::count_less(count, _heap.front().count)) {
+        std::pop_heap(_heap.begin(), _heap.end());
+        _heap.back().assign(std::forward<T>(args)...);
+        std::push_heap(_heap.begin(), _heap.end());
+      }
     } else {
       Entry e(std::forward<T>(args)...);
       if (e < _heap.front()) {
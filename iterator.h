@@ -1,14 +1,25 @@
 #pragma once
+#include <algorithm>
 #include <iterator>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "entry.h"
-#include "heap.h"
+#include "line_scan.h"
+#include "sst.h"
+
+void die(const char *fmt, ...);
 
 // Base class for input file
 template <typename T, typename Derived> class input_file_iter {
@@ -61,7 +72,9 @@ public:
 
   void close() {
     assert(_input);
-    assert(fclose(_input) == 0);
+    if (fclose(_input) != 0) {
+      die("Cannot close the input: %s\n", strerror(errno));
+    }
     _input = nullptr;
   }
 
@@ -72,31 +85,311 @@ private:
   value_type _e;
 };
 
-class sst_read_iter
-    : public input_file_iter<entry<slice_url_t>, sst_read_iter> {
+/* Decodes the blocks of an SST file (see sst.h) straight from a read only
+ * mapping of it. Keys at the restart points are views into the mapping, the
+ * others are rebuilt from the previous key, which only copies their suffix.
+ * Copies of the iterator share the mapping. */
+class sst_read_iter {
 public:
-  sst_read_iter(FILE *input) : input_file_iter(input) {}
+  using iterator_category = std::input_iterator_tag;
+  using value_type = entry<slice_url_t>;
+  using difference_type = ptrdiff_t;
+  using pointer = value_type *;
+  using reference = value_type &;
 
-  size_t read_buffer(char *buf, size_t size, FILE *input) {
-    size_t key_len;
-    if (fread(&key_len, sizeof(key_len), 1, input) != 1) {
-      return 0;
+  sst_read_iter(FILE *input) : sst_read_iter(input, 0, SIZE_MAX) {}
+
+  /* Only the entries with lo <= hash <= hi, found through the index */
+  sst_read_iter(FILE *input, size_t lo, size_t hi) : _input(input), _hi(hi) {
+    struct stat st;
+    if (fstat(fileno(input), &st) != 0) {
+      die("Cannot stat the sst: %s\n", strerror(errno));
+    }
+    _size = st.st_size;
+    if (_size < sst::header_size) {
+      // An empty file has no entries.
+      return;
     }
-    if (fread(buf, 1, key_len, input) != key_len) {
-      return 0;
+    void *addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+    if (addr == MAP_FAILED) {
+      die("Cannot map the sst: %s\n", strerror(errno));
     }
-    if (fread(&_count, sizeof(_count), 1, input) != 1) {
-      return 0;
+    // Runs are only read front to back, once, or a range of them.
+    madvise(addr, _size, MADV_SEQUENTIAL);
+    size_t size = _size;
+    _map = std::shared_ptr<const char>(
+        (const char *)addr, [size](const char *p) { munmap((void *)p, size); });
+    if (memcmp(_map.get(), sst::magic, sizeof(sst::magic)) != 0 ||
+        sst::get_fixed32(_map.get() + sizeof(sst::magic)) != sst::version) {
+      die("Unknown sst format\n");
     }
-    return key_len;
+    uint32_t codec_id = sst::get_fixed32(_map.get() + sizeof(sst::magic) +
+                                         sizeof(sst::version));
+    if (!(_codec = codec::find(codec_id))) {
+      die("The sst is compressed with codec %u, which this build lacks\n",
+          codec_id);
+    }
+    read_footer();
+    seek(lo);
   }
 
-  value_type construct_entry(char *buf, size_t size) {
-    return {slice_url_t(buf, size), _count};
+  /* Another iterator over lo <= hash <= hi of the same mapping, so that the
+   * ranges of a merge share one open file. Only the iterator that opened the
+   * file closes it. */
+  sst_read_iter range(size_t lo, size_t hi) const {
+    sst_read_iter iter(*this);
+    iter._input = nullptr;
+    iter._hi = hi;
+    if (iter._map) {
+      iter.seek(lo);
+    }
+    return iter;
+  }
+
+  value_type operator*() { return {url(), _count, _hash}; }
+
+  const value_type *operator->() {
+    // The key may live in _url, which moves along with the iterator.
+    _e = {url(), _count, _hash};
+    return &_e;
+  }
+
+  sst_read_iter &operator++() {
+    _valid = (_pos < _limit || read_block()) && decode_entry() && _hash <= _hi;
+    return *this;
+  }
+
+  bool valid() { return _valid; }
+
+  /* From the footer, for the whole file whatever the range */
+  size_t n_entries() const { return _n_entries; }
+
+  size_t min_hash() const { return _min_hash; }
+
+  size_t max_hash() const { return _max_hash; }
+
+  /* The hash of the first entry of every block, in order */
+  std::vector<size_t> block_hashes() const {
+    std::vector<size_t> hashes;
+    for (size_t i = 0; i < _n_blocks; i++) {
+      hashes.push_back(block_hash(i));
+    }
+    return hashes;
+  }
+
+  void close() {
+    assert(_input);
+    if (fclose(_input) != 0) {
+      die("Cannot close the sst: %s\n", strerror(errno));
+    }
+    _input = nullptr;
   }
 
 private:
-  count_t _count;
+  /* Starts over from the first entry with lo <= hash */
+  void seek(size_t lo) {
+    _next_block = sst::header_size;
+    _pos = _limit = _n_restarts = 0;
+    _decompressed = false;
+    _owned = false;
+    _key_len = 0;
+    if (lo > 0) {
+      // The last block that starts before lo may still hold some of it.
+      size_t first = 0, last = _n_blocks;
+      while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        if (block_hash(mid) < lo) {
+          first = mid + 1;
+        } else {
+          last = mid;
+        }
+      }
+      if (first > 0) {
+        _next_block = block_offset(first - 1);
+        if (read_block()) {
+          seek_in_block(lo);
+        }
+      }
+    }
+    ++*this;
+    while (_valid && _hash < lo) {
+      ++*this;
+    }
+  }
+
+  /* Moves to the last restart point of the current block with a hash below
+   * lo, what is before it is below lo as well. Restart points store their
+   * whole key, so decoding can start there. */
+  void seek_in_block(size_t lo) {
+    size_t first = 0, last = _n_restarts;
+    while (first < last) {
+      size_t mid = first + (last - first) / 2;
+      if (restart_hash(mid) < lo) {
+        first = mid + 1;
+      } else {
+        last = mid;
+      }
+    }
+    if (first > 0) {
+      _pos = restart_offset(first - 1);
+    }
+  }
+
+  size_t restart_offset(size_t i) const {
+    size_t offset = _block_begin + sst::get_fixed32(base() + _limit +
+                                                    i * sizeof(uint32_t));
+    if (offset >= _limit) {
+      die("Corrupted sst block\n");
+    }
+    return offset;
+  }
+
+  size_t restart_hash(size_t i) const {
+    const char *p = base() + restart_offset(i), *limit = base() + _limit;
+    uint64_t shared, non_shared, count;
+    if (!(p = sst::get_varint(p, limit, shared)) ||
+        !(p = sst::get_varint(p, limit, non_shared)) ||
+        !(p = sst::get_varint(p, limit, count)) || shared != 0 ||
+        (size_t)(limit - p) < sizeof(uint64_t)) {
+      die("Corrupted sst entry\n");
+    }
+    return sst::get_fixed64(p);
+  }
+
+  slice_url_t url() const {
+    return _owned ? slice_url_t(_url)
+                  : slice_url_t(base() + _key_offset, _key_len);
+  }
+
+  /* What the offsets of the current block are from: the mapping, or _block
+   * when it had to be decompressed */
+  const char *base() const {
+    return _decompressed ? _block.data() : _map.get();
+  }
+
+  void read_footer() {
+    if (_size < sst::header_size + sst::footer_size) {
+      die("Truncated sst\n");
+    }
+    const char *footer = _map.get() + _size - sst::footer_size;
+    if (memcmp(footer + sst::footer_size - sizeof(sst::magic), sst::magic,
+               sizeof(sst::magic)) != 0) {
+      die("Corrupted sst footer\n");
+    }
+    _index_offset = sst::get_fixed64(footer);
+    _n_blocks = sst::get_fixed64(footer + 8);
+    _n_entries = sst::get_fixed64(footer + 16);
+    _min_hash = sst::get_fixed64(footer + 24);
+    _max_hash = sst::get_fixed64(footer + 32);
+    if (_index_offset < sst::header_size ||
+        _index_offset > _size - sst::footer_size ||
+        _n_blocks != (_size - sst::footer_size - _index_offset) /
+                         sst::index_entry_size) {
+      die("Corrupted sst footer\n");
+    }
+  }
+
+  size_t block_offset(size_t i) const {
+    return sst::get_fixed64(_map.get() + _index_offset +
+                            i * sst::index_entry_size);
+  }
+
+  size_t block_hash(size_t i) const {
+    return sst::get_fixed64(_map.get() + _index_offset +
+                            i * sst::index_entry_size + sizeof(uint64_t));
+  }
+
+  bool read_block() {
+    if (_next_block + sst::block_header_size > _index_offset) {
+      return false;
+    }
+    uint32_t size = sst::get_fixed32(_map.get() + _next_block);
+    uint32_t raw_size =
+        sst::get_fixed32(_map.get() + _next_block + sizeof(uint32_t));
+    size_t begin = _next_block + sst::block_header_size;
+    if (size > _index_offset - begin) {
+      die("Truncated sst block\n");
+    }
+    _next_block = begin + size;
+    _decompressed = size != raw_size;
+    if (_decompressed) {
+      _block.resize(raw_size);
+      if (!_codec->decompress(_map.get() + begin, size, _block.data(),
+                              raw_size)) {
+        die("Corrupted sst block\n");
+      }
+      begin = 0;
+    }
+    if (raw_size < sizeof(uint32_t)) {
+      die("Corrupted sst block\n");
+    }
+    uint32_t n_restarts = sst::get_fixed32(base() + begin + raw_size - 4);
+    if ((n_restarts + 1) * sizeof(uint32_t) > raw_size) {
+      die("Corrupted sst block\n");
+    }
+    _pos = _block_begin = begin;
+    _limit = begin + raw_size - (n_restarts + 1) * sizeof(uint32_t);
+    _n_restarts = n_restarts;
+    return _pos < _limit;
+  }
+
+  bool decode_entry() {
+    const char *p = base() + _pos, *limit = base() + _limit;
+    uint64_t shared, non_shared;
+    if (!(p = sst::get_varint(p, limit, shared)) ||
+        !(p = sst::get_varint(p, limit, non_shared)) ||
+        !(p = sst::get_varint(p, limit, _count)) || shared > url().size() ||
+        (size_t)(limit - p) < sizeof(uint64_t) ||
+        non_shared > (size_t)(limit - p) - sizeof(uint64_t)) {
+      die("Corrupted sst entry\n");
+    }
+    _hash = sst::get_fixed64(p);
+    p += sizeof(uint64_t);
+    if (shared == 0) {
+      _owned = false;
+      _key_offset = p - base();
+      _key_len = non_shared;
+    } else {
+      if (!_owned) {
+        _url.assign(base() + _key_offset, shared);
+        _owned = true;
+      }
+      _url.resize(shared);
+      _url.append(p, non_shared);
+    }
+    _pos = p + non_shared - base();
+    return true;
+  }
+
+  FILE *_input;
+  std::shared_ptr<const char> _map;
+  const codec *_codec = nullptr;
+  size_t _size = 0;
+  size_t _hi = SIZE_MAX;
+  /* The data blocks end where the index starts */
+  size_t _index_offset = 0;
+  size_t _n_blocks = 0;
+  size_t _n_entries = 0;
+  size_t _min_hash = 0;
+  size_t _max_hash = 0;
+  /* Offsets rather than pointers, loser_tree_iter copies the iterators. */
+  size_t _next_block = 0;
+  bool _decompressed = false;
+  std::string _block;
+  size_t _pos = 0;
+  /* The entries end where the restart offsets start */
+  size_t _limit = 0;
+  size_t _block_begin = 0;
+  size_t _n_restarts = 0;
+  /* The key is either _url, or a view into the mapping */
+  bool _owned = false;
+  size_t _key_offset = 0;
+  size_t _key_len = 0;
+  std::string _url;
+  count_t _count = 0;
+  size_t _hash = 0;
+  bool _valid = false;
+  value_type _e;
 };
 
 class read_line_iter : public input_file_iter<slice_url_t, read_line_iter> {
@@ -120,14 +413,135 @@ public:
   }
 };
 
+/* A whole input file mapped read only. An empty file maps to nothing. */
+class mapped_file {
+public:
+  mapped_file(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      die("Cannot open the file: %s [%d %s]\n", path.c_str(), errno,
+          strerror(errno));
+    }
+    _size = st.st_size;
+    if (_size > 0) {
+      void *addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        die("Cannot map the file: %s [%d %s]\n", path.c_str(), errno,
+            strerror(errno));
+      }
+      madvise(addr, _size, MADV_SEQUENTIAL);
+      _data = (const char *)addr;
+    }
+    ::close(fd);
+  }
+
+  mapped_file(const mapped_file &) = delete;
+
+  ~mapped_file() {
+    if (_data) {
+      munmap((void *)_data, _size);
+    }
+  }
+
+  const char *data() const { return _data; }
+
+  size_t size() const { return _size; }
+
+  /* Moves offset forward to the start of the next line, unless it already is
+   * at the start of a line. */
+  size_t align_to_line(size_t offset) const {
+    if (offset == 0 || offset >= _size) {
+      return std::min(offset, _size);
+    }
+    const char *from = _data + offset - 1;
+    auto nl = (const char *)memchr(from, '\n', _data + _size - from);
+    return nl ? nl + 1 - _data : _size;
+  }
+
+private:
+  const char *_data = nullptr;
+  size_t _size = 0;
+};
+
+/* Yields the non empty lines in [begin, end) as views into the input, without
+ * copying them and without a limit on their length. Newlines are found 64
+ * bytes at a time (see line_scan.h). */
+class mapped_line_iter {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = slice_url_t;
+  using difference_type = ptrdiff_t;
+  using pointer = value_type *;
+  using reference = value_type &;
+
+  mapped_line_iter(const char *begin, const char *end)
+      : _pos(begin), _end(end), _block(begin), _mask(scan(begin)) {
+    ++*this;
+  }
+
+  value_type operator*() { return _line; }
+
+  const value_type *operator->() { return &_line; }
+
+  mapped_line_iter &operator++() {
+    while (_pos < _end) {
+      const char *nl = next_newline();
+      _line = slice_url_t(_pos, nl - _pos);
+      _pos = nl + 1;
+      if (!_line.empty()) {
+        return *this;
+      }
+    }
+    _line = {};
+    _valid = false;
+    return *this;
+  }
+
+  bool valid() { return _valid; }
+
+private:
+  /* The last line may not end with a newline, then end stands in for it. */
+  const char *next_newline() {
+    while (_mask == 0) {
+      _block += line_scan::block_size;
+      if (_block >= _end) {
+        return _end;
+      }
+      _mask = scan(_block);
+    }
+    const char *nl = _block + __builtin_ctzll(_mask);
+    _mask &= _mask - 1;
+    return nl;
+  }
+
+  uint64_t scan(const char *p) {
+    if ((size_t)(_end - p) >= line_scan::block_size) {
+      return line_scan::newline_mask(p);
+    }
+    return line_scan::newline_mask_scalar(p, _end - p);
+  }
+
+  const char *_pos;
+  const char *_end;
+  /* The block being scanned, and the newlines in it not consumed yet */
+  const char *_block;
+  uint64_t _mask;
+  slice_url_t _line;
+  bool _valid = true;
+};
+
 namespace {
 template <typename Iter>
 using iter_value_t = typename std::iterator_traits<Iter>::value_type;
 }
 
+/* k-way merge on a loser tree: _tree[1..k) hold the loser of each match, and
+ * _tree[0] the overall winner. Advancing only replays the matches on the path
+ * from the winner's leaf to the root, that is log(k) comparisons. */
 template <typename Iter, std::enable_if_t<is_entry<iter_value_t<Iter>>::value,
                                           void *> = nullptr>
-class merge_iter {
+class loser_tree_iter {
 public:
   using iterator_category = std::input_iterator_tag;
   using value_type = iter_value_t<Iter>;
@@ -138,37 +552,55 @@ public:
   template <typename Iters,
             std::enable_if_t<std::is_same_v<iter_value_t<Iters>, Iter>,
                              void *> = nullptr>
-  merge_iter(Iters begin, Iters end) : _iters(begin, end), _heap(end - begin) {
-    for (auto &iter : _iters) {
-      if (iter.valid()) {
-        _heap.add(&iter);
-      }
+  loser_tree_iter(Iters begin, Iters end)
+      : _iters(begin, end), _k(_iters.size()), _tree(std::max(_k, (size_t)1)) {
+    // Leaf k is a virtual leaf that beats everyone, so the first replay of
+    // every leaf fills the tree bottom up.
+    std::fill(_tree.begin(), _tree.end(), _k);
+    for (size_t i = _k; i-- > 0;) {
+      replay(i);
     }
   }
 
-  merge_iter &operator++() {
-    auto first = _heap.poll();
-    first.iter->operator++();
-    if (first.iter->valid()) {
-      _heap.add(first);
-    }
+  loser_tree_iter &operator++() {
+    size_t winner = _tree[0];
+    ++_iters[winner];
+    replay(winner);
     return *this;
   }
 
-  value_type operator*() { return _heap.front().iter->operator*(); }
+  value_type operator*() { return *_iters[_tree[0]]; }
 
-  const value_type *operator->() { return _heap.front().iter->operator->(); }
+  const value_type *operator->() { return _iters[_tree[0]].operator->(); }
 
-  bool valid() { return !_heap.empty(); }
+  bool valid() { return _k > 0 && _iters[_tree[0]].valid(); }
 
 private:
-  struct iter_p {
-    Iter *iter;
-    iter_p(Iter *i) : iter(i) {}
-    bool operator<(const iter_p &rhs) {
-      return (*iter)->url > (*rhs.iter)->url;
-    }
-  };
-  heap<iter_p> _heap;
+  /* Whether leaf a wins against leaf b, exhausted leaves always lose. */
+  bool beats(size_t a, size_t b) {
+    if (a == _k || b == _k) {
+      return a == _k;
+    }
+    if (!_iters[b].valid()) {
+      return true;
+    }
+    if (!_iters[a].valid()) {
+      return false;
+    }
+    return key_less(*_iters[a].operator->(), *_iters[b].operator->());
+  }
+
+  void replay(size_t leaf) {
+    size_t winner = leaf;
+    for (size_t node = (leaf + _k) / 2; node > 0; node /= 2) {
+      if (beats(_tree[node], winner)) {
+        std::swap(_tree[node], winner);
+      }
+    }
+    _tree[0] = winner;
+  }
+
   std::vector<Iter> _iters;
+  size_t _k;
+  std::vector<size_t> _tree;
 };
@@ -0,0 +1,64 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* Newline search, 64 bytes at a time. A mask has bit i set when p[i] is a
+ * '\n', so one scan finds every line end of a short line run at once. The
+ * vector kernels are picked at runtime, the binary does not need -mavx2. */
+namespace line_scan {
+constexpr size_t block_size = 64;
+
+/* Also serves the tail of the input, n <= block_size */
+inline uint64_t newline_mask_scalar(const char *p, size_t n = block_size) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < n; i++) {
+    mask |= (uint64_t)(p[i] == '\n') << i;
+  }
+  return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) inline uint64_t
+newline_mask_sse2(const char *p) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  uint64_t mask = 0;
+  for (size_t i = 0; i < block_size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) inline uint64_t
+newline_mask_avx2(const char *p) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+  uint32_t lo_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl));
+  uint32_t hi_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl));
+  return (uint64_t)hi_mask << 32 | lo_mask;
+}
+#endif
+
+using mask_fn = uint64_t (*)(const char *);
+
+inline mask_fn pick_newline_mask() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return newline_mask_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return newline_mask_sse2;
+  }
+#endif
+  return [](const char *p) { return newline_mask_scalar(p); };
+}
+
+/* The best kernel for this CPU, for a whole block at p */
+inline const mask_fn newline_mask = pick_newline_mask();
+} // namespace line_scan
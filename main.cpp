@@ -3,31 +3,64 @@
 #include <thread>
 #include <vector>
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "codec.h"
+#include "coordinator.h"
 #include "master.h"
-#include "memusage_guard.h"
+#include "memory_controller.h"
+#include "stream.h"
 
 constexpr size_t GB = 1'024 * 1'024 * 1'024;
+/* Long options without a short one */
+enum {
+  stats_option = 256,
+  window_option,
+  slide_option,
+  emit_option,
+  workers_option,
+  partition_option,
+  reduce_option,
+  spool_option,
+  compress_option,
+  spill_dir_option,
+};
 
-static master *master_ptr = nullptr;
 void usage(const char *);
-void flush_handler();
-
-struct master_guard {
-  // guard the master that is on stack.
-  master_guard(master *m) { master_ptr = m; }
-
-  ~master_guard() { master_ptr = nullptr; }
-};
 
 int main(int argc, char *argv[]) {
   int opt;
-  size_t limit = 1 * GB, watermark = 0.9 * GB, top_k = 100,
-         n_shards = std::thread::hardware_concurrency();
-  while ((opt = getopt(argc, argv, "l:w:t:s:")) != -1) {
+  size_t limit = 1 * GB, watermark = 0.95 * GB, top_k = 100, checkpoint = 0,
+         n_shards = std::thread::hardware_concurrency(),
+         n_threads = std::thread::hardware_concurrency();
+  count_mode mode = count_mode::exact;
+  bool stats = false;
+  double progress_interval = 1, emit_interval = 1;
+  window_length window, slide;
+  size_t n_workers = 0, partition = SIZE_MAX;
+  bool reduce = false;
+  std::string spool = "top100-spool";
+  const codec *compression = codec::none();
+  std::vector<std::string> spill_dirs;
+  static const option long_options[] = {
+      {"stats", optional_argument, nullptr, stats_option},
+      {"window", required_argument, nullptr, window_option},
+      {"slide", required_argument, nullptr, slide_option},
+      {"emit", required_argument, nullptr, emit_option},
+      {"workers", required_argument, nullptr, workers_option},
+      {"partition", required_argument, nullptr, partition_option},
+      {"reduce", no_argument, nullptr, reduce_option},
+      {"spool", required_argument, nullptr, spool_option},
+      {"compress", required_argument, nullptr, compress_option},
+      {"spill-dir", required_argument, nullptr, spill_dir_option},
+      {nullptr, 0, nullptr, 0},
+  };
+  while ((opt = getopt_long(argc, argv, "l:w:t:s:j:c:af", long_options,
+                            nullptr)) != -1) {
     switch (opt) {
     case 'l':
       limit = atoi(optarg);
@@ -41,11 +74,126 @@ int main(int argc, char *argv[]) {
     case 's':
       n_shards = atoi(optarg);
       break;
+    case 'j':
+      n_threads = atoi(optarg);
+      break;
+    case 'c':
+      checkpoint = atoll(optarg);
+      break;
+    case 'a':
+      mode = count_mode::approximate;
+      break;
+    case 'f':
+      mode = count_mode::filtered;
+      break;
+    case stats_option:
+      stats = true;
+      if (optarg) {
+        progress_interval = atof(optarg);
+      }
+      break;
+    case window_option:
+    case slide_option:
+      if (!window_length::parse(optarg,
+                                opt == window_option ? window : slide)) {
+        fprintf(stderr, "A window is a number of lines, or of seconds: 60s\n");
+        usage(argv[0]);
+      }
+      break;
+    case emit_option:
+      emit_interval = atof(optarg);
+      break;
+    case workers_option:
+      n_workers = atoi(optarg);
+      break;
+    case partition_option:
+      if (sscanf(optarg, "%zu/%zu", &partition, &n_workers) != 2 ||
+          partition >= n_workers) {
+        fprintf(stderr, "A partition is i/n, with i < n\n");
+        usage(argv[0]);
+      }
+      break;
+    case reduce_option:
+      reduce = true;
+      break;
+    case spool_option:
+      spool = optarg;
+      break;
+    case compress_option:
+      if (!(compression = codec::find(optarg))) {
+        fprintf(stderr, "Unknown codec %s, this build has: %s\n", optarg,
+                codec::names().c_str());
+        usage(argv[0]);
+      }
+      break;
+    case spill_dir_option:
+      spill_dirs.push_back(optarg);
+      break;
     default:
       fprintf(stderr, "Unrecognized option\n");
       usage(argv[0]);
     }
   }
+  if (window.length > 0) {
+    // Streaming: the input is optional, "-" or nothing is stdin.
+    slide = slide.length > 0 ? slide : window;
+    if (slide.unit != window.unit || window.length % slide.length != 0) {
+      fprintf(stderr, "The slide must divide the window, in the same unit\n");
+      usage(argv[0]);
+    }
+    int fd = 0;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+      fd = open(argv[optind], O_RDONLY);
+      if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    }
+    stream_master m(fd, window, slide, emit_interval, top_k, n_shards);
+    m.run();
+    return 0;
+  }
+  if (n_workers > 0 || reduce) {
+    if (mode != count_mode::exact || checkpoint > 0) {
+      fprintf(stderr, "Workers only count exactly, without checkpoints\n");
+      usage(argv[0]);
+    }
+    coordinator::options opts;
+    opts.inputs.assign(argv + optind, argv + argc);
+    opts.spool = spool;
+    opts.n_shards = n_shards;
+    opts.top_k = top_k;
+    opts.mem_high_water_mark = watermark;
+    opts.n_threads = n_threads;
+    opts.compression = compression;
+    opts.spill_dirs = spill_dirs;
+    if (partition != SIZE_MAX) {
+      // One worker of many, maybe on another host, the reduce comes later.
+      coordinator(opts).run_worker(partition, n_workers);
+      return 0;
+    }
+    if (n_workers > 0 && optind >= argc) {
+      fprintf(stderr, "Please indicate the input files\n");
+      usage(argv[0]);
+    }
+    if (n_workers > 0) {
+      // The workers share the memory and the cores of this host.
+      opts.mem_high_water_mark = watermark / n_workers;
+      opts.n_threads = std::max(n_threads / n_workers, (size_t)1);
+    }
+    coordinator c(opts);
+    if (n_workers > 0) {
+      c.fork_workers(n_workers);
+    }
+    c.reduce();
+    std::vector<coordinator::heap_type::iterator::value_type> result(
+        c.result_begin(), c.result_end());
+    std::sort(result.begin(), result.end());
+    for (const auto &e : result) {
+      printf("%s %lu\n", e.url.c_str(), e.count);
+    }
+    return 0;
+  }
   if (watermark > limit) {
     fprintf(stderr,
             "Watermark must be lower than limit, the given watermark: %lu, the "
@@ -53,22 +201,43 @@ int main(int argc, char *argv[]) {
             watermark, limit);
     usage(argv[0]);
   }
+  if (checkpoint > 0 && mode != count_mode::exact) {
+    fprintf(stderr, "Checkpoints only work with exact counts\n");
+    usage(argv[0]);
+  }
   if (optind >= argc) {
     fprintf(stderr, "Please indicate the input file\n");
     usage(argv[0]);
   }
   std::string input(argv[optind]);
   {
-    memusage_guard g(limit, flush_handler);
-    master m(std::move(input), n_shards, watermark, top_k);
-    master_guard m_instance(&m);
+    master m(std::move(input), n_shards, watermark, top_k, n_threads, mode);
+    // Declared after the master, so that it stops first.
+    memory_controller controller({limit, watermark});
+    controller.start([&m](size_t w) { m.limit_memory(w); },
+                     [&m](size_t bytes) { m.shed(bytes); });
+    if (stats) {
+      m.report_progress(progress_interval);
+    }
+    m.checkpoint_every(checkpoint);
+    m.compress_runs(compression);
+    m.spill_to(spill_dirs);
     m.start();
     m.wait_for_all_workers();
-    std::vector<entry<owned_url_t, false>> result(m.result_begin(),
-                                                  m.result_end());
+    std::vector<master::heap_type::iterator::value_type> result(
+        m.result_begin(), m.result_end());
     std::sort(result.begin(), result.end());
     for (const auto &e : result) {
-      printf("%s %lu\n", e.url.c_str(), e.count);
+      if (mode == count_mode::approximate) {
+        // The true count is within [count - error, count].
+        printf("%s %lu %lu\n", e.url.c_str(), e.count, e.error);
+      } else {
+        printf("%s %lu\n", e.url.c_str(), e.count);
+      }
+    }
+    if (stats) {
+      m.print_stats(stderr);
+      controller.print_stats(stderr);
     }
   }
 }
@@ -76,23 +245,14 @@ int main(int argc, char *argv[]) {
 void usage(const char *progname) {
   fprintf(
       stderr,
-      "%s [-l hard limit] [-w watermark] [-t topk] [-s shards] <linput file>\n",
-      progname);
+      "%s [-l hard limit] [-w watermark] [-t topk] [-s shards] [-j threads] "
+      "[-c checkpoint] [-a | -f] [--stats[=interval]] [--compress=codec] "
+      "[--spill-dir=dir]... <linput file>\n"
+      "%s [-t topk] [-s shards] --window=lines|seconds's' "
+      "[--slide=lines|seconds's'] [--emit=seconds] [input file | -]\n"
+      "%s [-w watermark] [-t topk] [-s shards] [-j threads] [--spool=dir] "
+      "[--compress=codec] [--spill-dir=dir]... --workers=n | --partition=i/n "
+      "| --reduce <input files>\n",
+      progname, progname, progname);
   exit(EXIT_FAILURE);
 }
-
-void flush_handler() {
-  if (master_ptr) {
-    if (master_ptr->flush_all() == 0) {
-      static const char msg[] =
-          "The limit is too low, cannot save more memory\n";
-      write(2, msg, sizeof(msg));
-      std::abort();
-    }
-  } else {
-    static const char msg[] = "flush_handler should be only called while the "
-                              "master instance is still on the stack\n";
-    write(2, msg, sizeof(msg));
-    std::abort();
-  }
-}
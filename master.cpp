@@ -1,153 +1,1265 @@
 #include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <sys/resource.h>
 
 #include "iterator.h"
 #include "master.h"
-#include "memusage_allocator.h"
+#include "sst.h"
 
 void die(const char *fmt, ...);
-size_t get_entry_overhead();
-static std::string get_sst_filename(size_t shard, size_t epoch);
+static void sync_file(FILE *file, const std::string &filename);
+static void sync_dir(const char *dirname);
 
-void master::on_new_url(std::string_view url) {
+/* Queue depth between a reader and an owner, in batches */
+static constexpr size_t queue_capacity = 16;
+/* Heavy hitter sampling: every sample_every-th url of an owner goes into its
+ * sampler, and every promote_every samples the urls whose guaranteed share of
+ * the samples is at least 1 / pin_share get pinned. */
+static constexpr size_t sample_every = 16;
+static constexpr size_t sampler_capacity = 256;
+static constexpr size_t promote_every = 4096;
+static constexpr size_t pin_share = 1024;
+static constexpr size_t max_pinned = 1024;
+/* What count_mode::approximate expects an average url to take */
+static constexpr size_t approx_url_size = 64;
+/* count_mode::filtered gives this share of the memory to the sketches, but no
+ * less than min_sketch_size bytes per shard. */
+static constexpr size_t sketch_budget_ratio = 4;
+static constexpr size_t min_sketch_size = 64 * 1024;
+/* Size-tiered compaction: runs within a factor of tier_ratio of each other
+ * share a tier, and once a tier has compaction_min_runs runs, up to
+ * compaction_max_runs of them are merged into one. */
+static constexpr size_t tier_ratio = 4;
+static constexpr size_t tier_base = 64 * 1024;
+static constexpr size_t compaction_min_runs = 4;
+static constexpr size_t compaction_max_runs = 16;
+/* Where the last checkpoint is, in the working directory */
+static constexpr const char *manifest_name = "checkpoint.manifest";
+static constexpr const char *manifest_magic = "top100-checkpoint 2";
+
+static double mib(size_t bytes) { return bytes / 1048576.0; }
+
+void master::on_new_url(std::string_view url, size_t hash) {
   // Find the right shard
-  std::hash<std::string_view> hasher;
-  size_t shard_no = hasher(url) % _n_shards;
-  auto it = _memtables[shard_no].find(url);
-  if (it == _memtables[shard_no].end()) {
-    _memtables[shard_no].insert({std::string(url), 1});
-    // Update the memory usage in the memtable
-    _mem_usage += estimate_map_entry_mem_usage(url);
-    _mem_usage_per_table[shard_no] += estimate_map_entry_mem_usage(url);
-    if (_mem_usage > _mem_high_water_mark) {
-      auto evict_shard =
-          std::max_element(_mem_usage_per_table.get(),
-                           _mem_usage_per_table.get() + _n_shards) -
-          _mem_usage_per_table.get();
-      flush_memtable(evict_shard);
+  size_t shard_no = hash % _n_shards;
+  if (_pinned[shard_no].increment(url, hash)) {
+    return;
+  }
+  sample_url(url, hash);
+  auto &table = _memtables[shard_no];
+  if (table.increment(url, hash)) {
+    return;
+  }
+  // Make room before the new key grows the table beyond the watermark. The
+  // frozen memtables still count until the flush thread is done with them.
+  size_t growth = table.growth(url);
+  size_t watermark = _watermark;
+  if (_mem_usage - _frozen_bytes + growth >
+      watermark - frozen_budget(watermark)) {
+    freeze_largest(owner_of(shard_no));
+  }
+  if (_mem_usage + growth > watermark) {
+    wait_for_flush(growth);
+  }
+  size_t before = table.mem_usage();
+  table.insert(url, hash);
+  // Update the memory usage in the memtable
+  _mem_usage += table.mem_usage() - before;
+  _memtable_bytes += table.mem_usage() - before;
+}
+
+void master::sample_url(std::string_view url, size_t hash) {
+  auto &hh = _heavy_hitters[owner_of(hash % _n_shards)];
+  if (++hh.n_urls % sample_every != 0) {
+    return;
+  }
+  hh.sampler.add(url, hash);
+  if (hh.sampler.total() % promote_every == 0) {
+    pin_heavy_hitters(owner_of(hash % _n_shards));
+  }
+}
+
+void master::make_heavy_hitters() {
+  _heavy_hitters.reserve(_n_owners);
+  for (size_t owner = 0; owner < _n_owners; owner++) {
+    _heavy_hitters.emplace_back(sampler_capacity);
+  }
+}
+
+void master::pin_heavy_hitters(size_t owner) {
+  auto &hh = _heavy_hitters[owner];
+  size_t limit = std::max(max_pinned / _n_owners, (size_t)1);
+  for (const auto &c : hh.sampler.counters()) {
+    if (hh.n_pinned >= limit) {
+      return;
+    }
+    if ((c.count - c.error) * pin_share < hh.sampler.total()) {
+      continue;
+    }
+    auto &pinned = _pinned[c.hash % _n_shards];
+    // The occurrences so far stay in the memtable and are flushed as usual,
+    // the pinned table only counts from now on.
+    if (!pinned.contains(c.url, c.hash)) {
+      size_t before = pinned.mem_usage();
+      pinned.insert(c.url, c.hash, 0);
+      _mem_usage += pinned.mem_usage() - before;
+      hh.n_pinned++;
     }
-  } else {
-    it->second++;
   }
 }
 
+size_t master::largest_memtable(size_t owner) {
+  size_t largest = owner;
+  for (size_t i = owner; i < _n_shards; i += _n_owners) {
+    if (_memtables[i].mem_usage() > _memtables[largest].mem_usage()) {
+      largest = i;
+    }
+  }
+  return largest;
+}
+
+void master::freeze_largest(size_t owner) {
+  // The watermark is global, and so is the victim. This thread holds the
+  // lock of its owner, the others are only tried.
+  std::vector<std::unique_lock<std::mutex>> locks;
+  bool busy = false;
+  size_t evict_shard = largest_memtable(owner);
+  for (size_t other = 0; other < _n_owners; other++) {
+    if (other == owner) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lk(_owner_mtx[other], std::try_to_lock);
+    if (!lk.owns_lock()) {
+      busy = true;
+      continue;
+    }
+    locks.push_back(std::move(lk));
+    size_t shard = largest_memtable(other);
+    if (_memtables[shard].mem_usage() > _memtables[evict_shard].mem_usage()) {
+      evict_shard = shard;
+    }
+  }
+  // Below the mean, a larger one is with a busy owner. Rather than writing
+  // a small run, hand it over to that owner.
+  size_t held = _memtable_bytes;
+  if (busy && _memtables[evict_shard].mem_usage() * _n_shards < held) {
+    _freeze_request = std::max(held / _n_shards, (size_t)1);
+    return;
+  }
+  // Nothing to save if all of them are empty.
+  if (!_memtables[evict_shard].empty()) {
+    freeze_memtable(evict_shard, _memtables[evict_shard]);
+  }
+}
+
+void master::freeze_memtable(size_t shard, memtable_type &table) {
+  std::lock_guard<std::mutex> lk(_flush_mtx);
+  _stats->observe_mem_usage(_mem_usage);
+  _frozen_bytes += table.mem_usage();
+  // The pinned tables are frozen too at a checkpoint.
+  if (&table == &_memtables[shard]) {
+    _memtable_bytes -= table.mem_usage();
+  }
+  _frozen.push_back({shard, _epochs[shard]++, std::move(table)});
+  _pool->submit([this] { flush_task(); });
+}
+
+void master::wait_for_flush(size_t growth) {
+  // Backpressure: the frozen budget is used up, so wait until the flush
+  // tasks made enough room, or have nothing left to flush.
+  std::unique_lock<std::mutex> lk(_flush_mtx);
+  _frozen_cv.wait(lk, [this, growth] {
+    return _mem_usage + growth <= _watermark || _frozen_bytes == 0;
+  });
+}
+
+void master::flush_task() {
+  // Owners may wait for this task, it must not wait for them.
+  std::unique_lock<std::mutex> lk(_flush_mtx);
+  // One task for every frozen memtable, the oldest one goes first.
+  auto frozen = std::move(_frozen.front());
+  _frozen.pop_front();
+  lk.unlock();
+  size_t bytes = write_memtable(frozen.table, frozen.shard, frozen.epoch);
+  add_run(frozen.shard, {frozen.epoch, bytes});
+  size_t saved = frozen.table.mem_usage();
+  frozen.table.clear();
+  lk.lock();
+  _mem_usage -= saved;
+  _frozen_bytes -= saved;
+  _frozen_cv.notify_all();
+}
+
 void master::start() {
-  FILE *input = ::fopen(_input_file.c_str(), "r");
-  if (!input) {
-    // No reason to recover if I can't even open the input file
-    die("Cannot open the file: %s [%d %s]\n", _input_file.c_str(), errno,
-        strerror(errno));
+  // No reason to recover if I can't even open the input file
+  mapped_file input(_input_file);
+  struct stat input_stat;
+  if (stat(_input_file.c_str(), &input_stat) != 0) {
+    die("Cannot stat the input file: %s\n", _input_file.c_str());
   }
-  read_line_iter line(input);
-  while (line.valid()) {
-    on_new_url(*line);
-    ++line;
+  _durable = _mode == count_mode::exact && _checkpoint_interval > 0;
+  if (_mode != count_mode::exact || !load_checkpoint(input_stat)) {
+    // Split the input into line aligned ranges, one for each reader.
+    size_t begin = input.align_to_line(std::min(_input_begin, input.size()));
+    size_t end = input.align_to_line(std::min(_input_end, input.size()));
+    end = std::max(begin, end);
+    _ranges.clear();
+    for (size_t i = 0; i < _n_readers; i++) {
+      size_t to = i + 1 == _n_readers
+                      ? end
+                      : begin + (end - begin) / _n_readers * (i + 1);
+      _ranges.push_back(
+          {i == 0 ? begin : _ranges.back().second, input.align_to_line(to)});
+    }
   }
-  assert(fclose(input) == 0);
-  for (int i = 0; i < _n_shards; i++) {
-    flush_memtable(i);
+  if (_progress_interval > 0) {
+    _progress_done = false;
+    _progress_thread = std::thread([this] { progress_worker(); });
   }
+
+  // What is left under the watermark
+  size_t budget = _mem_high_water_mark - std::min(_mem_high_water_mark,
+                                                  _mem_usage.load());
+  if (_mode == count_mode::approximate) {
+    make_summaries(budget);
+  }
+  if (_mode == count_mode::filtered) {
+    // The sketches stay for the second pass, next to the memtables.
+    size_t width = count_min_sketch::width_for(
+        std::max(budget / sketch_budget_ratio / _n_shards, min_sketch_size));
+    _sketches.clear();
+    _sketches.reserve(_n_shards);
+    size_t sketch_bytes = 0;
+    for (size_t shard = 0; shard < _n_shards; shard++) {
+      _sketches.emplace_back(width);
+      sketch_bytes += _sketches.back().mem_usage();
+    }
+    _mem_usage += sketch_bytes;
+    make_summaries(budget - std::min(budget, sketch_bytes));
+    _sketching = true;
+    ingest(input);
+    _sketching = false;
+    find_threshold();
+  }
+  ingest(input);
+  if (_durable) {
+    // The pinned counts go to the disk as well, then the last checkpoint
+    // covers the whole input and only the merge is left.
+    for (size_t shard = 0; shard < _n_shards; shard++) {
+      if (!_pinned[shard].empty()) {
+        flush_memtable(shard, _pinned[shard]);
+      }
+    }
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (const auto &range : _ranges) {
+      ranges.push_back({range.second, range.second});
+    }
+    write_checkpoint(ranges);
+  }
+  for (const auto &sketch : _sketches) {
+    _mem_usage -= sketch.mem_usage();
+  }
+  _sketches.clear();
+  if (_mode == count_mode::approximate) {
+    commit_summaries();
+    return;
+  }
+  _stats->begin_phase(master_stats::merge);
   for (size_t shard = 0; shard < _n_shards; shard++) {
-    spawn_worker([this, shard] { this->merge_worker(shard); });
+    _merges->submit([this, shard] { merge_worker(shard); });
   }
 }
 
-void write_sst(master::memtable_type memtable, FILE *output) {
-  for (const auto &e : memtable) {
-    size_t key_size = e.first.size();
-    // encoding: key_size, key, value
-    fwrite(&key_size, sizeof(size_t), 1, output);
-    fwrite(e.first.data(), 1, key_size, output);
-    fwrite(&e.second, sizeof(e.second), 1, output);
+void master::ingest(const mapped_file &input) {
+  _queues.clear();
+  for (size_t i = 0; i < _n_readers * _n_owners; i++) {
+    _queues.push_back(std::make_unique<spsc_queue<url_batch>>(queue_capacity));
+  }
+  _compaction_done = false;
+  _stats->begin_phase(master_stats::ingest);
+  // Readers and owners are threads of their own rather than pool tasks: they
+  // live for the whole phase, and an owner waits at the watermark for flush
+  // tasks, which a pool taken up by owners would never run.
+  std::vector<std::thread> ingest_threads;
+  for (size_t owner = 0; owner < _n_owners; owner++) {
+    ingest_threads.emplace_back([this, owner] { ingest_owner(owner); });
+  }
+  for (size_t reader = 0; reader < _n_readers; reader++) {
+    ingest_threads.emplace_back(
+        [this, reader, &input] { ingest_reader(reader, input); });
+  }
+  for (auto &&t : ingest_threads) {
+    t.join();
+  }
+  _stats->observe_mem_usage(_mem_usage);
+  _stats->end_phase(master_stats::ingest);
+  _stats->begin_phase(master_stats::drain);
+  wait_for_flushes();
+  // Whatever is left for compaction is cheaper to do in the final merge.
+  {
+    std::unique_lock<std::mutex> lk(_runs_mtx);
+    _compaction_done = true;
+    _compaction_idle_cv.wait(lk, [this] { return _compacting == 0; });
   }
-  fflush(output);
+  _stats->end_phase(master_stats::drain);
 }
 
-size_t master::flush_memtable(size_t shard) {
-  assert(shard < _n_shards);
-  auto filename = get_sst_filename(shard, _epochs[shard]);
+void master::ingest_reader(size_t reader, const mapped_file &input) {
+  std::hash<std::string_view> hasher;
+  std::vector<url_batch> pending(_n_owners);
+  auto [begin, end] = _ranges[reader];
+  // Every reader asks for a checkpoint after its share of the interval.
+  size_t stride = _checkpoint_interval == 0
+                      ? SIZE_MAX
+                      : std::max(_checkpoint_interval / _n_readers, (size_t)1);
+  size_t next_checkpoint = stride == SIZE_MAX ? SIZE_MAX : begin + stride;
+  auto &counters = _stats->readers[reader];
+  auto push = [this, reader, &counters](size_t owner, url_batch &&batch) {
+    counters.urls.add(batch.urls.size());
+    while (!queue(reader, owner).try_push(std::move(batch))) {
+      std::this_thread::yield();
+    }
+  };
+  mapped_line_iter line(input.data() + begin, input.data() + end);
+  while (line.valid()) {
+    slice_url_t url = *line;
+    size_t hash = hasher(url);
+    size_t owner = owner_of(hash % _n_shards);
+    pending[owner].add(url, hash);
+    if (pending[owner].full()) {
+      push(owner, std::move(pending[owner]));
+      pending[owner] = url_batch();
+    }
+    ++line;
+    size_t offset =
+        std::min((size_t)(url.data() - input.data()) + url.size() + 1, end);
+    if (offset >= next_checkpoint) {
+      // Everything before the marker is in front of it in the queues.
+      for (size_t owner = 0; owner < _n_owners; owner++) {
+        if (!pending[owner].urls.empty()) {
+          push(owner, std::move(pending[owner]));
+          pending[owner] = url_batch();
+        }
+        url_batch marker;
+        marker.checkpoint = true;
+        marker.offset = offset;
+        push(owner, std::move(marker));
+      }
+      next_checkpoint = offset + stride;
+    }
+  }
+  for (size_t owner = 0; owner < _n_owners; owner++) {
+    if (!pending[owner].urls.empty()) {
+      push(owner, std::move(pending[owner]));
+    }
+    url_batch eof;
+    eof.eof = true;
+    push(owner, std::move(eof));
+  }
+  counters.bytes.add(end - begin);
+}
+
+void master::ingest_owner(size_t owner) {
+  size_t live_readers = _n_readers;
+  // The readers whose checkpoint marker came in wait for the others. A reader
+  // that is done stays at the end of its range.
+  std::vector<bool> aligned(_n_readers), done(_n_readers);
+  std::vector<size_t> cut(_n_readers);
+  size_t n_aligned = 0;
+  url_batch batch;
+  while (live_readers > 0) {
+    bool idle = true;
+    for (size_t reader = 0; reader < _n_readers; reader++) {
+      if (aligned[reader] || !queue(reader, owner).try_pop(batch)) {
+        continue;
+      }
+      idle = false;
+      if (batch.eof || batch.checkpoint) {
+        live_readers -= batch.eof;
+        done[reader] = batch.eof;
+        cut[reader] = batch.eof ? _ranges[reader].second : batch.offset;
+        aligned[reader] = true;
+        if (++n_aligned == _n_readers && live_readers > 0) {
+          checkpoint_owner(owner, cut);
+          aligned = done;
+          n_aligned = _n_readers - live_readers;
+        }
+        continue;
+      }
+      std::lock_guard<std::mutex> lk(_owner_mtx[owner]);
+      shed_owner(owner);
+      _stats->owners[owner].urls.add(batch.urls.size());
+      if (_mode == count_mode::approximate) {
+        for (const auto &ref : batch.urls) {
+          _summaries[owner].add(ref.url, ref.hash);
+        }
+        continue;
+      }
+      if (_sketching) {
+        sketch_urls(owner, batch);
+        continue;
+      }
+      for (const auto &ref : batch.urls) {
+        // Not even the over-estimate reaches the top k.
+        if (_mode == count_mode::filtered &&
+            _sketches[ref.hash % _n_shards].estimate(ref.hash) < _threshold) {
+          continue;
+        }
+        on_new_url(ref.url, ref.hash);
+      }
+    }
+    if (idle) {
+      std::this_thread::yield();
+    }
+  }
+  // Hand the rest over to the flush tasks as well.
+  std::lock_guard<std::mutex> lk(_owner_mtx[owner]);
+  for (size_t shard = owner; shard < _n_shards; shard += _n_owners) {
+    if (!_memtables[shard].empty()) {
+      freeze_memtable(shard, _memtables[shard]);
+    }
+  }
+}
+
+size_t master::write_memtable(memtable_type &table, size_t shard,
+                              size_t epoch) {
+  auto filename = sst_filename(shard, epoch);
   FILE *output = fopen(filename.c_str(), "w+b");
   if (!output) {
     die("Cannot write to sst file: %s, err: %s\n", filename.c_str(),
         strerror(errno));
   }
-  write_sst(std::move(_memtables[shard]), output);
-  assert(fclose(output) == 0);
-  // Adjust the memory usage estimation.
-  size_t saved = _mem_usage_per_table[shard];
-  _mem_usage -= _mem_usage_per_table[shard];
-  _mem_usage_per_table[shard] = 0;
-  _epochs[shard]++;
-  return saved;
+  write_sst(table.sorted(), output, _codec);
+  size_t bytes = ftell(output);
+  if (_durable) {
+    sync_file(output, filename);
+  }
+  if (fclose(output) != 0) {
+    die("Cannot write to sst file: %s, err: %s\n", filename.c_str(),
+        strerror(errno));
+  }
+  _stats->flushes++;
+  _stats->flush_bytes += bytes;
+  return bytes;
 }
 
-size_t master::estimate_map_entry_mem_usage(std::string_view url) {
-  static size_t entry_overhead = std::max(get_entry_overhead(), (size_t)72);
-  return url.size() + entry_overhead;
+void master::add_run(size_t shard, sst_run run) {
+  std::lock_guard<std::mutex> lk(_runs_mtx);
+  _runs[shard].push_back(run);
+  schedule_compactions();
 }
 
-void master::merge_worker(size_t shard) {
+void master::schedule_compactions() {
+  // Called with _runs_mtx held. The other half of the pool is for flushes.
+  size_t limit = std::max(_n_threads / 2, (size_t)1);
+  size_t shard;
+  std::vector<sst_run> inputs;
+  while (!_compaction_done && !_checkpointing && _compacting < limit &&
+         pick_compaction(shard, inputs)) {
+    _compacting++;
+    _pool->submit([this, shard, inputs = std::move(inputs)] {
+      compaction_task(shard, inputs);
+    });
+    inputs.clear();
+  }
+}
+
+void master::compaction_task(size_t shard, const std::vector<sst_run> &inputs) {
+  sst_run output = compact(shard, inputs);
+  std::lock_guard<std::mutex> lk(_runs_mtx);
+  _runs[shard].push_back(output);
+  if (_durable) {
+    // The last manifest may still list the inputs.
+    _obsolete[shard].insert(_obsolete[shard].end(), inputs.begin(),
+                            inputs.end());
+  }
+  _compacting--;
+  _compaction_idle_cv.notify_all();
+  schedule_compactions();
+}
+
+bool master::pick_compaction(size_t &shard, std::vector<sst_run> &inputs) {
+  auto tier_of = [](size_t bytes) {
+    size_t tier = 0;
+    for (bytes /= tier_base; bytes >= tier_ratio; bytes /= tier_ratio) {
+      tier++;
+    }
+    return tier;
+  };
+  for (shard = 0; shard < _n_shards; shard++) {
+    auto &runs = _runs[shard];
+    if (runs.size() < compaction_min_runs) {
+      continue;
+    }
+    // Group the runs of a tier together, the smallest tiers first.
+    std::stable_sort(runs.begin(), runs.end(),
+                     [&](const sst_run &lhs, const sst_run &rhs) {
+                       return tier_of(lhs.bytes) < tier_of(rhs.bytes);
+                     });
+    for (size_t i = 0, j; i < runs.size(); i = j) {
+      size_t tier = tier_of(runs[i].bytes);
+      for (j = i + 1; j < runs.size() && tier_of(runs[j].bytes) == tier; j++) {
+      }
+      if (j - i >= compaction_min_runs) {
+        j = std::min(j, i + compaction_max_runs);
+        inputs.assign(runs.begin() + i, runs.begin() + j);
+        runs.erase(runs.begin() + i, runs.begin() + j);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+master::sst_run master::compact(size_t shard,
+                                const std::vector<sst_run> &inputs) {
   std::vector<sst_read_iter> iters;
-  master::heap_type private_heap(_top_k);
-  // 1. create all sst_iters.
-  for (size_t epoch = 0; epoch < _epochs[shard]; epoch++) {
-    auto filename = get_sst_filename(shard, epoch);
+  for (const auto &run : inputs) {
+    auto filename = sst_filename(shard, run.epoch);
     FILE *input = fopen(filename.c_str(), "rb");
     if (!input) {
       die("Cannot open the staged sst: %s\n", filename.c_str());
     }
     iters.emplace_back(input);
   }
-  // 2. use merge_iter to merge the result and save it in private workspace.
-  merge_iter<sst_read_iter> miter(iters.begin(), iters.end());
-  owned_url_t last_url = "";
-  count_t last_count = 0;
-  while (miter.valid()) {
-    if (miter->url != last_url) {
-      if (last_url != "") {
-        private_heap.add(std::move(last_url), last_count);
-      }
-      last_url = miter->url;
-      last_count = miter->count;
-    } else {
-      last_count += miter->count;
-    }
-    ++miter;
+  sst_run output{_epochs[shard]++, 0};
+  auto filename = sst_filename(shard, output.epoch);
+  FILE *out = fopen(filename.c_str(), "w+b");
+  if (!out) {
+    die("Cannot write to sst file: %s, err: %s\n", filename.c_str(),
+        strerror(errno));
+  }
+  // Sum up the counts of the same url across the inputs.
+  sst_writer writer(out, _codec);
+  key_aggregator aggregator(
+      [&](slice_url_t url, count_t count, size_t hash) {
+        writer.add(url, count, hash);
+      });
+  for (loser_tree_iter<sst_read_iter> miter(iters.begin(), iters.end());
+       miter.valid(); ++miter) {
+    aggregator.add(*miter.operator->());
   }
-  if (last_url != "") {
-    private_heap.add(std::move(last_url), last_count);
+  aggregator.finish();
+  writer.finish();
+  output.bytes = ftell(out);
+  if (_durable) {
+    sync_file(out, filename);
   }
-  // 3. close all files;
+  if (fclose(out) != 0) {
+    die("Cannot write the compacted sst: %s, err: %s\n", filename.c_str(),
+        strerror(errno));
+  }
+  _stats->compactions++;
   for (auto &iter : iters) {
     iter.close();
   }
-  // 4. commit the entries from the private workspace to the result in master
-  for (auto &&e : private_heap) {
+  if (_durable) {
+    return output;
+  }
+  for (const auto &run : inputs) {
+    auto filename = sst_filename(shard, run.epoch);
+    if (unlink(filename.c_str()) != 0) {
+      die("Cannot remove the staged sst: %s\n", filename.c_str());
+    }
+  }
+  return output;
+}
+
+size_t master::flush_memtable(size_t shard, memtable_type &table) {
+  assert(shard < _n_shards);
+  size_t epoch = _epochs[shard]++;
+  size_t bytes = write_memtable(table, shard, epoch);
+  add_run(shard, {epoch, bytes});
+  // Adjust the memory usage.
+  size_t saved = table.mem_usage();
+  _mem_usage -= saved;
+  table.clear();
+  return saved;
+}
+
+void master::limit_memory(size_t watermark) {
+  // An eighth of the room the memtables were given is left at least.
+  size_t room = _mem_high_water_mark -
+                std::min(_mem_high_water_mark, _baseline_usage);
+  _watermark = std::max(watermark, _baseline_usage + room / 8);
+  // A higher one lets the owners that wait for a flush go on.
+  std::lock_guard<std::mutex> lk(_flush_mtx);
+  _frozen_cv.notify_all();
+}
+
+void master::wait_for_flushes() {
+  std::unique_lock<std::mutex> lk(_flush_mtx);
+  _frozen_cv.wait(lk,
+                  [this] { return _frozen.empty() && _frozen_bytes == 0; });
+}
+
+void master::shed(size_t bytes) {
+  // Every call replaces the last request, there is no more to shed than the
+  // memtables that are still counting. The pinned tables and the sketches
+  // are not theirs to give.
+  bytes = std::min(bytes, _memtable_bytes.load());
+  if (bytes == 0) {
+    _shed_request = 0;
+    return;
+  }
+  std::vector<std::unique_lock<std::mutex>> locks;
+  std::vector<size_t> shards;
+  for (size_t owner = 0; owner < _n_owners; owner++) {
+    std::unique_lock<std::mutex> lk(_owner_mtx[owner], std::try_to_lock);
+    if (!lk.owns_lock()) {
+      continue;
+    }
+    for (size_t shard = owner; shard < _n_shards; shard += _n_owners) {
+      if (!_memtables[shard].empty()) {
+        shards.push_back(shard);
+      }
+    }
+    locks.push_back(std::move(lk));
+  }
+  std::sort(shards.begin(), shards.end(), [this](size_t lhs, size_t rhs) {
+    return _memtables[lhs].mem_usage() > _memtables[rhs].mem_usage();
+  });
+  size_t frozen = 0;
+  for (size_t i = 0; i < shards.size() && frozen < bytes; i++) {
+    frozen += _memtables[shards[i]].mem_usage();
+    _stats->shed_bytes += _memtables[shards[i]].mem_usage();
+    freeze_memtable(shards[i], _memtables[shards[i]]);
+  }
+  // The busy owners do the rest.
+  _shed_request = bytes - std::min(bytes, frozen);
+}
+
+void master::shed_owner(size_t owner) {
+  // Some owner found no memtable this large it could freeze itself. Owners
+  // racing on the request may both freeze theirs.
+  size_t wanted = _freeze_request.load(std::memory_order_relaxed);
+  if (wanted > 0) {
+    size_t shard = largest_memtable(owner);
+    if (_memtables[shard].mem_usage() >= wanted) {
+      _freeze_request = 0;
+      freeze_memtable(shard, _memtables[shard]);
+    }
+  }
+  while (_shed_request.load(std::memory_order_relaxed) > 0) {
+    size_t shard = largest_memtable(owner);
+    size_t bytes = _memtables[shard].mem_usage();
+    if (_memtables[shard].empty()) {
+      return;
+    }
+    // Owners racing on the request may shed a little more than asked.
+    size_t left = _shed_request;
+    _shed_request = left - std::min(left, bytes);
+    _stats->shed_bytes += bytes;
+    freeze_memtable(shard, _memtables[shard]);
+  }
+}
+
+void master::merge_worker(size_t shard) {
+  auto started = master_stats::clock::now();
+  auto &stats = _stats->merges[shard];
+  // A resumed run may have merged this shard before.
+  if (_durable && load_result(shard)) {
+    for (const auto &run : _runs[shard]) {
+      unlink(sst_filename(shard, run.epoch).c_str());
+    }
+    return;
+  }
+  // An exported shard gets all of its counts, not only the top k, in order.
+  std::string exported = export_filename(shard);
+  FILE *export_file = nullptr;
+  std::optional<sst_writer> writer;
+  std::vector<hash_range> ranges = {{0, SIZE_MAX}};
+  // Every run is opened once, the ranges read it through iterators of their
+  // own.
+  std::vector<sst_read_iter> runs;
+  for (const auto &run : _runs[shard]) {
+    auto filename = sst_filename(shard, run.epoch);
+    FILE *input = fopen(filename.c_str(), "rb");
+    if (!input) {
+      die("Cannot open the staged sst: %s\n", filename.c_str());
+    }
+    runs.emplace_back(input);
+  }
+  if (!exported.empty()) {
+    export_file = fopen((exported + ".tmp").c_str(), "wb");
+    if (!export_file) {
+      die("Cannot write to the exported sst: %s, err: %s\n", exported.c_str(),
+          strerror(errno));
+    }
+    writer.emplace(export_file, _codec);
+  } else {
+    ranges = split_shard(shard, runs);
+  }
+  for (const auto &run : _runs[shard]) {
+    stats.bytes += run.bytes;
+  }
+  stats.fan_in = _runs[shard].size();
+  stats.ranges = ranges.size();
+  // 1. merge every range into a private workspace, together with the pinned
+  // urls that never went to the disk.
+  auto pinned = _pinned[shard].sorted();
+  std::vector<master::heap_type> heaps(ranges.size(), heap_type(_top_k));
+  std::vector<merge_stats> parts(ranges.size());
+  task_group group(*_pool);
+  for (size_t i = 1; i < ranges.size(); i++) {
+    group.submit([&, i] {
+      merge_range(runs, ranges[i], pinned, heaps[i], parts[i], nullptr);
+    });
+  }
+  merge_range(runs, ranges[0], pinned, heaps[0], parts[0],
+              writer ? &*writer : nullptr);
+  group.wait();
+  for (auto &run : runs) {
+    run.close();
+  }
+  if (writer) {
+    writer->finish();
+    if (fclose(export_file) != 0 ||
+        rename((exported + ".tmp").c_str(), exported.c_str()) != 0) {
+      die("Cannot write to the exported sst: %s, err: %s\n", exported.c_str(),
+          strerror(errno));
+    }
+  }
+  // 2. the ranges are disjoint, so the top k of the shard is in their top k.
+  master::heap_type private_heap(_top_k);
+  for (size_t i = 0; i < ranges.size(); i++) {
+    for (auto &&e : heaps[i]) {
+      private_heap.add(std::move(e.url), e.count);
+    }
+    stats.entries += parts[i].entries;
+    stats.distinct += parts[i].distinct;
+  }
+  _mem_usage -= _pinned[shard].mem_usage();
+  _pinned[shard].clear();
+  if (_durable) {
+    save_result(shard, private_heap);
+  }
+  // 3. commit the entries from the private workspace to the result in master,
+  // in a task of its own so that the files go away in the meantime.
+  _merges->submit([this, heap = std::move(private_heap)]() mutable {
     std::lock_guard<std::mutex> lk(_result_mtx);
-    _result.add(std::move(e.url), e.count);
+    for (auto &&e : heap) {
+      _result.add(std::move(e.url), e.count);
+    }
+  });
+  // 4. remove all the files
+  for (const auto &run : _runs[shard]) {
+    auto filename = sst_filename(shard, run.epoch);
+    if (unlink(filename.c_str()) != 0) {
+      die("Cannot remove the staged sst: %s\n", filename.c_str());
+    }
+  }
+  std::chrono::duration<double> elapsed = master_stats::clock::now() - started;
+  stats.seconds = elapsed.count();
+}
+
+std::vector<master::hash_range>
+master::split_shard(size_t shard,
+                    const std::vector<sst_read_iter> &runs) const {
+  // The shard gets the share of the threads that its bytes are of all the
+  // runs: a hot shard is split whatever the number of shards.
+  size_t bytes = 0, total = 0;
+  for (size_t i = 0; i < _n_shards; i++) {
+    for (const auto &run : _runs[i]) {
+      total += run.bytes;
+      bytes += i == shard ? run.bytes : 0;
+    }
+  }
+  if (bytes == 0) {
+    return {{0, SIZE_MAX}};
+  }
+  size_t n_ranges = (_n_threads * bytes + total / 2) / total;
+  if (n_ranges <= 1) {
+    return {{0, SIZE_MAX}};
+  }
+  // Blocks are about the same size, so their first hashes are quantiles of
+  // the bytes to merge.
+  std::vector<size_t> hashes;
+  for (const auto &run : runs) {
+    auto blocks = run.block_hashes();
+    hashes.insert(hashes.end(), blocks.begin(), blocks.end());
+  }
+  std::sort(hashes.begin(), hashes.end());
+  n_ranges = std::min(n_ranges, hashes.size() / min_range_blocks);
+  std::vector<hash_range> ranges;
+  size_t lo = 0;
+  for (size_t i = 1; i < n_ranges; i++) {
+    size_t split = hashes[hashes.size() * i / n_ranges];
+    if (split > lo) {
+      ranges.push_back({lo, split - 1});
+      lo = split;
+    }
+  }
+  ranges.push_back({lo, SIZE_MAX});
+  return ranges;
+}
+
+void master::merge_range(const std::vector<sst_read_iter> &runs,
+                         hash_range range, memtable_type::sorted_view pinned,
+                         heap_type &heap, merge_stats &stats,
+                         sst_writer *writer) {
+  std::vector<sst_read_iter> iters;
+  for (const auto &run : runs) {
+    iters.push_back(run.range(range.first, range.second));
+  }
+  loser_tree_iter<sst_read_iter> miter(iters.begin(), iters.end());
+  using pinned_entry = memtable_type::entry_type;
+  auto pinned_it = std::lower_bound(
+      pinned.begin(), pinned.end(), range.first,
+      [](const pinned_entry &e, size_t hash) { return e.hash < hash; });
+  auto pinned_end = std::upper_bound(
+      pinned_it, pinned.end(), range.second,
+      [](size_t hash, const pinned_entry &e) { return hash < e.hash; });
+  // The heap only copies the urls it takes, so no url allocates here.
+  key_aggregator aggregator(
+      [&](slice_url_t url, count_t count, size_t hash) {
+        if (writer) {
+          writer->add(url, count, hash);
+        } else {
+          heap.add(url, count);
+        }
+        stats.distinct++;
+      });
+  while (miter.valid() || pinned_it != pinned_end) {
+    stats.entries++;
+    if (pinned_it != pinned_end &&
+        (!miter.valid() || !key_less(*miter.operator->(), *pinned_it))) {
+      aggregator.add(*pinned_it);
+      ++pinned_it;
+    } else {
+      aggregator.add(*miter.operator->());
+      ++miter;
+    }
+  }
+  aggregator.finish();
+}
+
+std::string master::export_filename(size_t shard) const {
+  if (_export_prefix.empty()) {
+    return {};
+  }
+  return _export_prefix + "shard-" + std::to_string(shard) + "-of-" +
+         std::to_string(_n_shards) + ".sst";
+}
+
+void master::sketch_urls(size_t owner, const url_batch &batch) {
+  for (const auto &ref : batch.urls) {
+    _sketches[ref.hash % _n_shards].add(ref.hash);
+    _summaries[owner].add(ref.url, ref.hash);
+  }
+}
+
+void master::make_summaries(size_t budget) {
+  size_t capacity =
+      budget / _n_owners / (space_saving::counter_overhead() + approx_url_size);
+  _summaries.clear();
+  _summaries.reserve(_n_owners);
+  for (size_t owner = 0; owner < _n_owners; owner++) {
+    _summaries.emplace_back(std::max(capacity, _top_k));
+  }
+}
+
+void master::find_threshold() {
+  // At least k urls occur at least as often as the k-th largest lower bound,
+  // so a url that occurs less often cannot be in the top k.
+  std::vector<count_t> lower_bounds;
+  for (const auto &summary : _summaries) {
+    for (const auto &c : summary.counters()) {
+      lower_bounds.push_back(c.count - c.error);
+    }
+  }
+  _summaries.clear();
+  _threshold = 0;
+  if (_top_k > 0 && lower_bounds.size() >= _top_k) {
+    std::nth_element(lower_bounds.begin(), lower_bounds.begin() + _top_k - 1,
+                     lower_bounds.end(), std::greater<count_t>());
+    _threshold = lower_bounds[_top_k - 1];
+  }
+}
+
+void master::commit_summaries() {
+  // The owners see disjoint sets of urls, so no url is split across them.
+  for (const auto &summary : _summaries) {
+    for (const auto &c : summary.counters()) {
+      _result.add(c.url, c.count, c.error);
+    }
+  }
+  _summaries.clear();
+}
+
+void master::progress_worker() {
+  auto interval = std::chrono::duration<double>(_progress_interval);
+  std::unique_lock<std::mutex> lk(_progress_mtx);
+  while (!_progress_cv.wait_for(lk, interval,
+                                [this] { return _progress_done; })) {
+    int phase = _stats->current_phase;
+    if (phase == master_stats::n_phases) {
+      continue;
+    }
+    std::chrono::duration<double> elapsed =
+        master_stats::clock::now() - _stats->started;
+    size_t mem_usage = _mem_usage;
+    _stats->observe_mem_usage(mem_usage);
+    size_t lines = master_stats::sum(_stats->readers, &ingest_counters::urls);
+    fprintf(stderr,
+            "[%7.1fs] %s: %zu lines (%.0f/s), mem %.1fM of %.1fM, "
+            "%zu flushes (%.1fM), %zu compactions\n",
+            elapsed.count(), master_stats::phase_names[phase], lines,
+            lines / elapsed.count(), mib(mem_usage), mib(_watermark),
+            _stats->flushes.load(), mib(_stats->flush_bytes),
+            _stats->compactions.load());
+  }
+}
+
+void master::stop_progress() {
+  if (!_progress_thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(_progress_mtx);
+    _progress_done = true;
+    _progress_cv.notify_one();
+  }
+  _progress_thread.join();
+}
+
+void master::print_stats(FILE *out) {
+  const auto &s = *_stats;
+  fprintf(out, "phases:");
+  for (int p = 0; p < master_stats::n_phases; p++) {
+    fprintf(out, " %s %.3fs", master_stats::phase_names[p],
+            s.phase_seconds[p]);
   }
-  // 5. remove all the files
-  for (size_t epoch = 0; epoch < _epochs[shard]; epoch++) {
-    auto filename = get_sst_filename(shard, epoch);
-    assert(unlink(filename.c_str()) == 0);
+  size_t lines = master_stats::sum(s.readers, &ingest_counters::urls);
+  size_t bytes = master_stats::sum(s.readers, &ingest_counters::bytes);
+  double seconds = std::max(s.phase_seconds[master_stats::ingest], 1e-9);
+  fprintf(out, "\ninput: %zu lines, %.1fM read, %.0f lines/s, %.1fM/s\n",
+          lines, mib(bytes), lines / seconds, mib(bytes) / seconds);
+  fprintf(out, "owners:");
+  for (const auto &c : s.owners) {
+    fprintf(out, " %zu", c.urls.get());
   }
+  fprintf(out,
+          " urls\nflushes: %zu, %.1fM written, %zu compactions, "
+          "%zu checkpoints\n",
+          s.flushes.load(), mib(s.flush_bytes), s.compactions.load(),
+          s.checkpoints.load());
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out,
+          "memory: peak %.1fM accounted, peak rss %.1fM, watermark %.1fM, "
+          "%.1fM shed\n",
+          mib(s.peak_mem_usage), mib(usage.ru_maxrss * 1024),
+          mib(_mem_high_water_mark), mib(s.shed_bytes));
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    const auto &m = s.merges[shard];
+    fprintf(out,
+            "shard %zu: %zu epochs, fan-in %zu, %zu ranges, %.1fM, "
+            "%zu entries, %zu distinct, %.3fs (%.0f entries/s)\n",
+            shard, _epochs[shard].load(), m.fan_in, m.ranges, mib(m.bytes),
+            m.entries, m.distinct, m.seconds,
+            m.entries / std::max(m.seconds, 1e-9));
+  }
+}
+
+void master::checkpoint_owner(size_t owner, const std::vector<size_t> &cut) {
+  {
+    std::lock_guard<std::mutex> lk(_owner_mtx[owner]);
+    for (size_t shard = owner; shard < _n_shards; shard += _n_owners) {
+      if (!_memtables[shard].empty()) {
+        freeze_memtable(shard, _memtables[shard]);
+      }
+      // The urls get pinned again as they come up in the samples.
+      if (!_pinned[shard].empty()) {
+        freeze_memtable(shard, _pinned[shard]);
+      }
+    }
+    _heavy_hitters[owner].n_pinned = 0;
+  }
+  std::unique_lock<std::mutex> lk(_checkpoint_mtx);
+  size_t generation = _checkpoint_generation;
+  if (++_checkpoint_arrived < _n_owners) {
+    _checkpoint_cv.wait(
+        lk, [&] { return _checkpoint_generation != generation; });
+    return;
+  }
+  // The other owners wait, so all that is frozen is from before the cut.
+  {
+    std::unique_lock<std::mutex> flush_lk(_flush_mtx);
+    _frozen_cv.wait(flush_lk, [this] { return _frozen_bytes == 0; });
+  }
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (size_t reader = 0; reader < _n_readers; reader++) {
+    ranges.push_back({cut[reader], _ranges[reader].second});
+  }
+  write_checkpoint(ranges);
+  _checkpoint_arrived = 0;
+  _checkpoint_generation++;
+  _checkpoint_cv.notify_all();
+}
+
+void master::write_checkpoint(
+    const std::vector<std::pair<size_t, size_t>> &ranges) {
+  std::unique_lock<std::mutex> lk(_runs_mtx);
+  // No new compaction starts, or the running ones may never be done.
+  _checkpointing = true;
+  _compaction_idle_cv.wait(lk, [this] { return _compacting == 0; });
+  // The runs are synced already, their names are not yet.
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    for (size_t i = 0; i < _spill_dirs.size(); i++) {
+      sync_dir(shard_dir(shard, i).c_str());
+    }
+  }
+  struct stat input;
+  if (stat(_input_file.c_str(), &input) != 0) {
+    die("Cannot stat the input file: %s\n", _input_file.c_str());
+  }
+  std::string tmp = std::string(manifest_name) + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    die("Cannot write the checkpoint: %s, err: %s\n", tmp.c_str(),
+        strerror(errno));
+  }
+  fprintf(out, "%s\ninput %zu %ld %ld\nshards %zu\nspill dirs %zu\n"
+          "ranges %zu\n",
+          manifest_magic, (size_t)input.st_size, (long)input.st_mtim.tv_sec,
+          (long)input.st_mtim.tv_nsec, _n_shards, _spill_dirs.size(),
+          ranges.size());
+  for (const auto &range : ranges) {
+    fprintf(out, "%zu %zu\n", range.first, range.second);
+  }
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    fprintf(out, "shard %zu %zu %zu\n", shard, _epochs[shard].load(),
+            _runs[shard].size());
+    for (const auto &run : _runs[shard]) {
+      fprintf(out, "%zu %zu\n", run.epoch, run.bytes);
+    }
+  }
+  sync_file(out, tmp);
+  if (fclose(out) != 0 || rename(tmp.c_str(), manifest_name) != 0) {
+    die("Cannot write the checkpoint: %s, err: %s\n", manifest_name,
+        strerror(errno));
+  }
+  sync_dir(".");
+  // Nothing refers to the compaction inputs any more.
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    for (const auto &run : _obsolete[shard]) {
+      unlink(sst_filename(shard, run.epoch).c_str());
+    }
+    _obsolete[shard].clear();
+  }
+  _stats->checkpoints++;
+  _checkpointing = false;
+  schedule_compactions();
+}
+
+bool master::load_checkpoint(const struct stat &input) {
+  FILE *in = fopen(manifest_name, "r");
+  if (!in) {
+    return false;
+  }
+  char magic[64] = {0};
+  size_t size, n_shards, n_spill_dirs, n_ranges;
+  long mtime_sec, mtime_nsec;
+  if (!fgets(magic, sizeof(magic), in) ||
+      strncmp(magic, manifest_magic, strlen(manifest_magic)) != 0 ||
+      fscanf(in, " input %zu %ld %ld shards %zu spill dirs %zu ranges %zu",
+             &size, &mtime_sec, &mtime_nsec, &n_shards, &n_spill_dirs,
+             &n_ranges) != 6) {
+    die("Cannot read the checkpoint: %s\n", manifest_name);
+  }
+  if (size != (size_t)input.st_size || mtime_sec != input.st_mtim.tv_sec ||
+      mtime_nsec != input.st_mtim.tv_nsec) {
+    die("The checkpoint %s is for another input, remove it to start over\n",
+        manifest_name);
+  }
+  if (n_shards != _n_shards || n_ranges == 0) {
+    die("The checkpoint %s was made with %zu shards\n", manifest_name,
+        n_shards);
+  }
+  // Where a run is follows from the number of directories, not their names.
+  if (n_spill_dirs != _spill_dirs.size()) {
+    die("The checkpoint %s was made with %zu spill directories\n",
+        manifest_name, n_spill_dirs);
+  }
+  _ranges.resize(n_ranges);
+  for (auto &range : _ranges) {
+    if (fscanf(in, "%zu %zu", &range.first, &range.second) != 2) {
+      die("Cannot read the checkpoint: %s\n", manifest_name);
+    }
+  }
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    size_t id, epoch, n_runs;
+    if (fscanf(in, " shard %zu %zu %zu", &id, &epoch, &n_runs) != 3 ||
+        id != shard) {
+      die("Cannot read the checkpoint: %s\n", manifest_name);
+    }
+    _epochs[shard] = epoch;
+    _runs[shard].resize(n_runs);
+    for (auto &run : _runs[shard]) {
+      if (fscanf(in, "%zu %zu", &run.epoch, &run.bytes) != 2) {
+        die("Cannot read the checkpoint: %s\n", manifest_name);
+      }
+    }
+  }
+  fclose(in);
+  // The readers go on from where the checkpoint left them.
+  _n_readers = _ranges.size();
+  _stats = std::make_unique<master_stats>(_n_readers, _n_owners, _n_shards);
+  _durable = true;
+  remove_stray_runs();
+  return true;
+}
+
+void master::remove_stray_runs() {
+  // Runs written after the checkpoint, and compaction inputs that were kept
+  // for it.
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    for (size_t i = 0; i < _spill_dirs.size(); i++) {
+      std::string dirname = shard_dir(shard, i);
+      DIR *dir = opendir(dirname.c_str());
+      if (!dir) {
+        continue;
+      }
+      while (dirent *e = readdir(dir)) {
+        size_t epoch;
+        int n = 0;
+        if (sscanf(e->d_name, "stage-%zu.sst%n", &epoch, &n) != 1 ||
+            e->d_name[n] != '\0') {
+          continue;
+        }
+        auto &runs = _runs[shard];
+        if (std::none_of(runs.begin(), runs.end(),
+                         [epoch](const sst_run &run) {
+                           return run.epoch == epoch;
+                         })) {
+          unlink((dirname + "/" + e->d_name).c_str());
+        }
+      }
+      closedir(dir);
+    }
+  }
+}
+
+void master::remove_checkpoint() {
+  // The results first, they are only read along with the manifest.
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    unlink(result_filename(shard).c_str());
+  }
+  unlink(manifest_name);
+}
+
+bool master::load_result(size_t shard) {
+  auto filename = result_filename(shard);
+  FILE *in = fopen(filename.c_str(), "r");
+  if (!in) {
+    return false;
+  }
+  char *line = nullptr;
+  size_t capacity = 0;
+  ssize_t n;
+  std::lock_guard<std::mutex> lk(_result_mtx);
+  while ((n = getline(&line, &capacity, in)) > 0) {
+    count_t count;
+    int url_start;
+    if (sscanf(line, "%lu %n", &count, &url_start) != 1) {
+      die("Cannot read the merge result: %s\n", filename.c_str());
+    }
+    _result.add(owned_url_t(line + url_start, n - url_start - 1), count);
+  }
+  free(line);
+  fclose(in);
+  return true;
+}
+
+void master::save_result(size_t shard, heap_type &result) {
+  auto filename = result_filename(shard);
+  std::string tmp = filename + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    die("Cannot write the merge result: %s, err: %s\n", tmp.c_str(),
+        strerror(errno));
+  }
+  for (const auto &e : result) {
+    fprintf(out, "%lu %s\n", e.count, e.url.c_str());
+  }
+  sync_file(out, tmp);
+  if (fclose(out) != 0 || rename(tmp.c_str(), filename.c_str()) != 0) {
+    die("Cannot write the merge result: %s, err: %s\n", filename.c_str(),
+        strerror(errno));
+  }
+  sync_dir(shard_dir(shard, shard % _spill_dirs.size()).c_str());
+}
+
+void sync_file(FILE *file, const std::string &filename) {
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+    die("Cannot sync %s, err: %s\n", filename.c_str(), strerror(errno));
+  }
+}
+
+void sync_dir(const char *dirname) {
+  int fd = open(dirname, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fsync(fd) != 0) {
+    die("Cannot sync the directory %s, err: %s\n", dirname, strerror(errno));
+  }
+  close(fd);
+}
+
+size_t master::resident_usage() {
+  size_t npage, garbage;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm || fscanf(statm, "%zu %zu", &garbage, &npage) != 2) {
+    die("Cannot read /proc/self/statm, err: %s\n", strerror(errno));
+  }
+  fclose(statm);
+  return npage * getpagesize();
+}
+
+void master::spill_to(std::vector<std::string> dirs) {
+  if (dirs.empty()) {
+    return;
+  }
+  remove_shard_dirs();
+  for (const auto &dir : dirs) {
+    mkdir(dir.c_str(), 0700);
+  }
+  _spill_dirs = std::move(dirs);
+  make_shard_dirs();
+}
+
+void master::make_shard_dirs() {
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    for (size_t i = 0; i < _spill_dirs.size(); i++) {
+      std::string dir = shard_dir(shard, i);
+      if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        die("Cannot create %s, err: %s\n", dir.c_str(), strerror(errno));
+      }
+    }
+  }
+}
+
+void master::remove_shard_dirs() {
+  for (size_t shard = 0; shard < _n_shards; shard++) {
+    for (size_t i = 0; i < _spill_dirs.size(); i++) {
+      rmdir(shard_dir(shard, i).c_str());
+    }
+  }
+}
+
+std::string master::shard_dir(size_t shard, size_t spill_dir) const {
+  return _spill_dirs[spill_dir] + "/_" + std::to_string(shard);
 }
 
-size_t get_entry_overhead() {
-  std::map<owned_url_t, count_t, std::less<>,
-           memusage_allocator<std::pair<owned_url_t, count_t>>>
-      m;
-  memusage_measure_guard g;
-  m.insert({"", 1});
-  return g.current_usage();
+std::string master::result_filename(size_t shard) const {
+  return shard_dir(shard, shard % _spill_dirs.size()) + "/result.txt";
 }
 
-std::string get_sst_filename(size_t shard, size_t epoch) {
-  constexpr size_t filename_size = 64;
-  char filename[filename_size];
-  /* filename schema: stage-(shard)-(epoch) */
-  int n = snprintf(filename, filename_size, "_%lu/stage-%lu.sst", shard, epoch);
-  return {filename, (size_t)n};
+std::string master::sst_filename(size_t shard, size_t epoch) const {
+  /* filename schema: <spill dir>/_<shard>/stage-<epoch>.sst */
+  return shard_dir(shard, (shard + epoch) % _spill_dirs.size()) + "/stage-" +
+         std::to_string(epoch) + ".sst";
 }
 
 void die(const char *format, ...) {
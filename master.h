@@ -1,7 +1,12 @@
 #pragma once
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -12,94 +17,351 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "codec.h"
+#include "count_min.h"
 #include "entry.h"
 #include "heap.h"
+#include "memtable.h"
+#include "space_saving.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "task_pool.h"
 #include "types.h"
 
+class sst_writer;
+
+class sst_read_iter;
+
+class mapped_file;
+
+enum class count_mode {
+  /* Spills to SSTs when needed, the counts are exact */
+  exact,
+  /* One pass with Space-Saving summaries within the watermark, no spills */
+  approximate,
+  /* Exact, in two passes: the first one sketches the counts, the second one
+   * only counts the urls that can still make it into the top k. */
+  filtered,
+};
+
 class master {
 public:
-  /* Use the transparent compare */
-  using memtable_type = std::map<owned_url_t, count_t, std::less<>>;
-  using heap_type = heap<entry<owned_url_t, false>>;
+  using memtable_type = memtable;
+  using heap_type = heap<approx_entry<owned_url_t, false>>;
+
+  /* Lines are handed from the readers to the shard owners in batches. The
+   * urls are views into the mapped input. */
+  struct url_batch {
+    static constexpr size_t max_urls = 4096;
+
+    struct url_ref {
+      size_t hash;
+      slice_url_t url;
+    };
+    std::vector<url_ref> urls;
+    bool eof = false;
+    /* A checkpoint marker: the reader got to offset in the input */
+    bool checkpoint = false;
+    size_t offset = 0;
+
+    void add(slice_url_t url, size_t hash) { urls.push_back({hash, url}); }
+
+    bool full() const { return urls.size() >= max_urls; }
+  };
 
+  /* Half of the ingest threads split and hash lines, the other half own the
+   * shards and their memtables. As many threads flush, compact and merge. */
   master(std::string input, size_t n_shards, size_t mem_high_water_mark,
-         size_t top_k)
-      : _n_shards(n_shards), _mem_usage(0),
-        _mem_high_water_mark(mem_high_water_mark), _top_k(top_k),
+         size_t top_k,
+         size_t n_ingest_threads = std::thread::hardware_concurrency(),
+         count_mode mode = count_mode::exact)
+      : _n_shards(n_shards), _mode(mode), _mem_usage(0),
+        _mem_high_water_mark(mem_high_water_mark),
+        _watermark(mem_high_water_mark), _top_k(top_k),
         _result(top_k), _input_file(std::move(input)),
+        _n_threads(std::max(n_ingest_threads, (size_t)1)),
         _memtables(std::make_unique<memtable_type[]>(n_shards)),
-        _mem_usage_per_table(std::make_unique<size_t[]>(n_shards)),
-        _epochs(std::make_unique<size_t[]>(n_shards)) {
-    size_t npage, garbage;
-    FILE *statm = fopen("/proc/self/statm", "r");
-    assert(statm != NULL);
-    assert(fscanf(statm, "%lu %lu", &garbage, &npage) == 2);
-    _mem_usage = npage * getpagesize();
-    assert(fclose(statm) == 0);
-    for (int i = 0; i < _n_shards; i++) {
-      char buf[4];
-      sprintf(buf, "_%d", i);
-      struct stat st = {0};
-      if (stat(buf, &st) == -1) {
-        mkdir(buf, 0700);
-      }
-    }
+        _pinned(std::make_unique<memtable_type[]>(n_shards)),
+        _epochs(std::make_unique<std::atomic<size_t>[]>(n_shards)),
+        _runs(n_shards), _obsolete(n_shards) {
+    _n_readers = std::max(n_ingest_threads / 2, (size_t)1);
+    _n_owners = std::clamp(n_ingest_threads - _n_readers, (size_t)1,
+                           std::max(n_shards, (size_t)1));
+    _stats = std::make_unique<master_stats>(_n_readers, _n_owners, n_shards);
+    _owner_mtx = std::make_unique<std::mutex[]>(_n_owners);
+    _mem_usage = resident_usage();
+    _baseline_usage = _mem_usage;
+    make_heavy_hitters();
+    make_shard_dirs();
+    _pool = std::make_unique<task_pool>(_n_threads);
+    _merges = std::make_unique<task_group>(*_pool);
   }
 
   ~master() {
     /* Make sure when the master is dropped, all threads are waited */
     wait_for_all_workers();
-    for (int i = 0; i < _n_shards; i++) {
-      char buf[4];
-      sprintf(buf, "_%d", i);
-      rmdir(buf);
-    }
-  }
-
-  template <typename F> void spawn_worker(F &&f) {
-    _worker_threads.emplace_back(std::forward<F>(f));
+    remove_shard_dirs();
   }
 
   void wait_for_all_workers() {
-    std::vector<std::thread> current_threads;
-    current_threads.swap(_worker_threads);
-    for (auto &&t : current_threads) {
-      t.join();
+    _merges->wait();
+    if (_stats->current_phase == master_stats::merge) {
+      _stats->end_phase(master_stats::merge);
+      _stats->current_phase = master_stats::n_phases;
+      if (_durable) {
+        remove_checkpoint();
+      }
     }
+    stop_progress();
   }
 
   void start();
+  /* Merges the runs of a shard, split into key ranges that are merged side by
+   * side when there are more threads than shards. */
   void merge_worker(size_t shard);
 
   heap_type::iterator result_begin() { return _result.begin(); }
 
   heap_type::iterator result_end() { return _result.end(); }
 
-  size_t flush_all() {
-    size_t flushed = 0;
-    for (size_t i = 0; i < _n_shards; i++) {
-      flushed += flush_memtable(i);
-    }
-    return flushed;
+  /* The watermark of the memtables from now on, for a memory_controller. It
+   * never goes so low that the memtables get no room at all. */
+  void limit_memory(size_t watermark);
+
+  /* Freezes the largest memtables, about bytes of them but no more than they
+   * hold: right away for the owners that are not busy, the others do it
+   * before their next batch. A call replaces what the last one asked for, 0
+   * withdraws it. The flushes run in the pool. */
+  void shed(size_t bytes);
+
+  /* Prints a progress line to stderr every interval seconds from start() on,
+   * until the workers are done. Call it before start(). */
+  void report_progress(double interval) { _progress_interval = interval; }
+  /* The counters and timers of the whole run */
+  void print_stats(FILE *out);
+  const master_stats &stats() const { return *_stats; }
+
+  /* count_mode::exact: write a checkpoint every interval bytes of input, a
+   * master started after a crash goes on from the last one. Call it before
+   * start(). */
+  void checkpoint_every(size_t interval) { _checkpoint_interval = interval; }
+
+  /* Only counts the lines that start in [begin, end) of the input. Both are
+   * moved to the start of a line, so that ranges that meet split the input
+   * without overlapping. */
+  void restrict_input(size_t begin, size_t end) {
+    _input_begin = begin;
+    _input_end = end;
   }
 
+  /* Instead of keeping the top k, the merge writes all the counts of a shard
+   * to prefix + "shard-<shard>-of-<shards>.sst", in the order of the runs. */
+  void export_runs(std::string prefix) { _export_prefix = std::move(prefix); }
+
+  /* The blocks of the flushes, the compactions and the exports go through c.
+   * Call it before start(). */
+  void compress_runs(const codec *c) { _codec = c; }
+
+  /* Spreads the runs over dirs, one per disk, instead of the working
+   * directory. Call it before start(). */
+  void spill_to(std::vector<std::string> dirs);
+
 private:
+  /* The tests look at the internals through it */
+  friend struct master_access;
+
   size_t _n_shards;
-  size_t _mem_usage;
+  count_mode _mode;
+  std::atomic<size_t> _mem_usage;
+  /* As given, and as the memory_controller moves it */
   size_t _mem_high_water_mark;
+  std::atomic<size_t> _watermark;
+  /* What the process held before the first memtable */
+  size_t _baseline_usage;
   size_t _top_k;
   std::string _input_file;
+  /* The threads of the task pool. Phase 2 splits every shard into key ranges
+   * by its share of the bytes of all the runs, so that the ranges of all the
+   * shards make about as many tasks. Each range spans at least
+   * min_range_blocks blocks of the runs. */
+  size_t _n_threads;
+  static constexpr size_t min_range_blocks = 16;
+  size_t _input_begin = 0;
+  size_t _input_end = SIZE_MAX;
+  std::string _export_prefix;
+  /* Every shard has a directory _<shard> in each of them. The runs of a
+   * shard go round-robin by epoch, starting from a different directory for
+   * every shard, so that the flushes, the compactions and the merges of all
+   * the shards keep every disk busy. */
+  std::vector<std::string> _spill_dirs{"."};
+  const codec *_codec = codec::none();
   std::unique_ptr<memtable_type[]> _memtables;
-  std::unique_ptr<size_t[]> _mem_usage_per_table;
-  std::unique_ptr<size_t[]> _epochs;
-  std::vector<std::thread> _worker_threads;
+  /* Heavy hitters are counted here and never flushed. */
+  std::unique_ptr<memtable_type[]> _pinned;
+  /* Next file id of each shard, compaction takes ids as well */
+  std::unique_ptr<std::atomic<size_t>[]> _epochs;
+
+  /* Ingest pipeline: _queues[reader * _n_owners + owner] */
+  size_t _n_readers;
+  /* The part of the input each reader reads, [begin, end) */
+  std::vector<std::pair<size_t, size_t>> _ranges;
+  size_t _n_owners;
+  std::vector<std::unique_ptr<spsc_queue<url_batch>>> _queues;
+  /* Held by an owner while it works on its memtables */
+  std::unique_ptr<std::mutex[]> _owner_mtx;
+
+  /* Samples the traffic of an owner to find the urls worth pinning */
+  struct heavy_hitters {
+    space_saving sampler;
+    size_t n_urls = 0;
+    size_t n_pinned = 0;
+
+    heavy_hitters(size_t capacity) : sampler(capacity) {}
+  };
+  std::vector<heavy_hitters> _heavy_hitters;
+  /* count_mode::approximate counts everything here, one per owner. The first
+   * pass of count_mode::filtered finds the lower bounds here. */
+  std::vector<space_saving> _summaries;
+  /* count_mode::filtered: one sketch per shard, and the k-th largest lower
+   * bound found by the first pass. No url below it is counted. */
+  std::vector<count_min_sketch> _sketches;
+  count_t _threshold = 0;
+  bool _sketching = false;
+
+  /* A memtable that is full and waits for a flush task */
+  struct frozen_memtable {
+    size_t shard;
+    size_t epoch;
+    memtable_type table;
+  };
+  std::mutex _flush_mtx;
+  /* Wakes up the owners waiting for a flush to finish */
+  std::condition_variable _frozen_cv;
+  std::deque<frozen_memtable> _frozen;
+  /* Memory held by the frozen memtables, including the one being flushed */
+  std::atomic<size_t> _frozen_bytes{0};
+  /* Memory held by the memtables that still count, all that can be frozen */
+  std::atomic<size_t> _memtable_bytes{0};
+  /* A part of what the memtables may use under the watermark is for the
+   * frozen ones. Once the active memtables grow beyond the rest, the largest
+   * one is frozen. */
+  static constexpr size_t frozen_budget_ratio = 4;
+  /* What shed() left to the owners that were busy */
+  std::atomic<size_t> _shed_request{0};
+  /* The size of a memtable that freeze_largest() left to a busy owner */
+  std::atomic<size_t> _freeze_request{0};
+  size_t frozen_budget(size_t watermark) const {
+    return (watermark - std::min(watermark, _baseline_usage)) /
+           frozen_budget_ratio;
+  }
+
+  /* The sorted runs of each shard on the disk: flushed memtables and the
+   * outputs of compaction. A run being compacted is not in the list. */
+  struct sst_run {
+    size_t epoch;
+    size_t bytes;
+  };
+  std::mutex _runs_mtx;
+  std::vector<std::vector<sst_run>> _runs;
+  bool _compaction_done = false;
+  /* Compaction tasks in the pool, at most half of its threads */
+  size_t _compacting = 0;
+  /* A checkpoint waits for the compactions, none is started meanwhile */
+  bool _checkpointing = false;
+  /* Wakes up a checkpoint waiting for the compactions to finish */
+  std::condition_variable _compaction_idle_cv;
+
+  /* Checkpoints: the owners line up behind a marker from every reader, and
+   * freeze what they counted before it. Once that is on the disk, the last
+   * owner to arrive writes the manifest: where every reader is, and the runs
+   * of every shard. */
+  size_t _checkpoint_interval = 0;
+  /* The runs are fsynced and compaction keeps its inputs until the next
+   * manifest, because checkpoints are on or this run was resumed. */
+  bool _durable = false;
+  std::mutex _checkpoint_mtx;
+  std::condition_variable _checkpoint_cv;
+  size_t _checkpoint_arrived = 0;
+  size_t _checkpoint_generation = 0;
+  /* Compaction inputs that the last manifest may still refer to */
+  std::vector<std::vector<sst_run>> _obsolete;
 
   std::mutex _result_mtx;
   heap_type _result;
 
-  size_t flush_memtable(size_t shard);
+  std::unique_ptr<master_stats> _stats;
+  double _progress_interval = 0;
+  std::mutex _progress_mtx;
+  std::condition_variable _progress_cv;
+  bool _progress_done = false;
+  std::thread _progress_thread;
+
+  /* Last, so that no task outlives what it works on */
+  std::unique_ptr<task_pool> _pool;
+  std::unique_ptr<task_group> _merges;
+
+  size_t flush_memtable(size_t shard, memtable_type &table);
+  size_t write_memtable(memtable_type &table, size_t shard, size_t epoch);
+  void add_run(size_t shard, sst_run run);
+  void schedule_compactions();
+  void compaction_task(size_t shard, const std::vector<sst_run> &inputs);
+  bool pick_compaction(size_t &shard, std::vector<sst_run> &inputs);
+  sst_run compact(size_t shard, const std::vector<sst_run> &inputs);
+  void freeze_memtable(size_t shard, memtable_type &table);
+  /* The shard of owner with the largest memtable */
+  size_t largest_memtable(size_t owner);
+  /* Freezes the largest memtable of all the owners, called by owner */
+  void freeze_largest(size_t owner);
+  /* Serves _freeze_request and _shed_request with the memtables of owner,
+   * before its next batch */
+  void shed_owner(size_t owner);
+  void wait_for_flush(size_t growth);
+  /* Waits until the frozen memtables are written */
+  void wait_for_flushes();
+  void flush_task();
+
+  size_t owner_of(size_t shard) { return shard % _n_owners; }
+  spsc_queue<url_batch> &queue(size_t reader, size_t owner) {
+    return *_queues[reader * _n_owners + owner];
+  }
+  void ingest(const mapped_file &input);
+  void ingest_reader(size_t reader, const mapped_file &input);
+  void ingest_owner(size_t owner);
+  void sketch_urls(size_t owner, const url_batch &batch);
 
   size_t current_mem_usage();
-  void on_new_url(std::string_view url);
-  static size_t estimate_map_entry_mem_usage(std::string_view url);
+  void on_new_url(std::string_view url, size_t hash);
+  void sample_url(std::string_view url, size_t hash);
+  void make_heavy_hitters();
+  void pin_heavy_hitters(size_t owner);
+  void make_summaries(size_t budget);
+  void commit_summaries();
+  void find_threshold();
+  void progress_worker();
+  void stop_progress();
+
+  void checkpoint_owner(size_t owner, const std::vector<size_t> &cut);
+  void write_checkpoint(const std::vector<std::pair<size_t, size_t>> &ranges);
+  bool load_checkpoint(const struct stat &input);
+  void remove_stray_runs();
+  /* The resident bytes of the process, from /proc/self/statm */
+  static size_t resident_usage();
+  void make_shard_dirs();
+  void remove_shard_dirs();
+  std::string shard_dir(size_t shard, size_t spill_dir) const;
+  std::string sst_filename(size_t shard, size_t epoch) const;
+  /* Next to the first run of the shard */
+  std::string result_filename(size_t shard) const;
+  void remove_checkpoint();
+  bool load_result(size_t shard);
+  std::string export_filename(size_t shard) const;
+  void save_result(size_t shard, heap_type &result);
+  /* Inclusive ranges of hashes that split the runs of a shard evenly */
+  using hash_range = std::pair<size_t, size_t>;
+  std::vector<hash_range> split_shard(size_t shard,
+                                      const std::vector<sst_read_iter> &runs)
+      const;
+  void merge_range(const std::vector<sst_read_iter> &runs, hash_range range,
+                   memtable_type::sorted_view pinned, heap_type &heap,
+                   merge_stats &stats, sst_writer *writer);
 };
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory_controller.h"
+
+/* The RSS stays this share of the budget below it, for what the flushes and
+ * the merges allocate for a moment. */
+static constexpr size_t headroom_ratio = 16;
+/* Under pressure the watermark shrinks at most to this share of itself */
+static constexpr double min_pressure_scale = 0.5;
+
+static double mib(size_t bytes) { return bytes / 1048576.0; }
+
+memory_controller::memory_controller(options opts)
+    : _opts(opts),
+      _cgroup_dir(find_cgroup("/proc/self/cgroup", "/sys/fs/cgroup")) {
+  if (_cgroup_dir.empty()) {
+    // Hybrid hierarchies mount cgroup v2 apart.
+    _cgroup_dir = find_cgroup("/proc/self/cgroup", "/sys/fs/cgroup/unified");
+  }
+}
+
+memory_controller::~memory_controller() {
+  stop();
+  release_reserve();
+}
+
+void memory_controller::start(set_watermark_fn set_watermark, shed_fn shed) {
+  _set_watermark = std::move(set_watermark);
+  _shed = std::move(shed);
+  take_reserve();
+  instance = this;
+  std::set_new_handler(new_handler);
+  tick();
+  _thread = std::thread([this] { worker(); });
+}
+
+void memory_controller::stop() {
+  if (!_thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(_mtx);
+    _stopping = true;
+  }
+  _cv.notify_one();
+  _thread.join();
+  std::set_new_handler(nullptr);
+  instance = nullptr;
+}
+
+void memory_controller::worker() {
+  auto interval = std::chrono::duration<double>(_opts.interval);
+  std::unique_lock<std::mutex> lk(_mtx);
+  while (!_cv.wait_for(lk, interval, [this] { return _stopping; })) {
+    lk.unlock();
+    tick();
+    lk.lock();
+  }
+}
+
+memory_controller::decision
+memory_controller::decide(const sample &s) const {
+  decision d;
+  // What the cgroup leaves: its limit, less what the others in it hold. The
+  // others are everything memory.max counts but the anonymous RSS: the other
+  // processes, the kernel memory, and the page cache of the spilled runs.
+  // The inactive file cache is left out, the kernel drops it before anything
+  // gets killed.
+  size_t others = s.cgroup_current - std::min(s.cgroup_current, s.rss);
+  d.budget = std::min(_opts.limit,
+                      s.cgroup_max - std::min(s.cgroup_max, others));
+  size_t target = d.budget - d.budget / headroom_ratio;
+  // A smaller budget than the limit takes the watermark down with it.
+  size_t watermark = _opts.watermark;
+  if (d.budget < _opts.limit) {
+    watermark = (size_t)((double)watermark * d.budget / _opts.limit);
+  }
+  watermark = std::min(watermark, target);
+  if (s.pressure >= _opts.pressure_threshold) {
+    watermark *= std::max(1 - s.pressure / 100, min_pressure_scale);
+  }
+  // The memtables are not all there is: what is beyond the target comes off
+  // the watermark, and is flushed now.
+  d.shed = s.rss > target ? s.rss - target : 0;
+  d.watermark = watermark - std::min(watermark, d.shed);
+  d.release_reserve = s.rss + d.budget / (2 * headroom_ratio) > d.budget;
+  return d;
+}
+
+void memory_controller::tick() {
+  sample s = read_sample();
+  decision d = decide(s);
+  bool starved = _starved.exchange(false);
+  if (d.release_reserve || starved) {
+    if (release_reserve()) {
+      _reserve_releases++;
+    }
+  } else if (s.rss + 2 * _opts.reserve <
+             d.budget - d.budget / headroom_ratio) {
+    // Far enough from the budget again.
+    take_reserve();
+  }
+  _set_watermark(d.watermark);
+  // After a failed allocation, at least the headroom goes.
+  size_t shed =
+      starved ? std::max(d.shed, d.budget / headroom_ratio) : d.shed;
+  _shed(shed);
+  if (shed > 0) {
+    _sheds++;
+    // Freed memory that malloc keeps still counts in the RSS.
+    malloc_trim(0);
+  }
+  _ticks++;
+  _min_watermark = std::min(_min_watermark.load(), d.watermark);
+  _peak_rss = std::max(_peak_rss.load(), s.rss);
+}
+
+bool memory_controller::take_reserve() {
+  std::lock_guard<std::mutex> lk(_reserve_mtx);
+  if (_reserve || _opts.reserve == 0) {
+    return true;
+  }
+  // malloc rather than new, a failure must not end up in new_handler.
+  _reserve = malloc(_opts.reserve);
+  if (!_reserve) {
+    return false;
+  }
+  // Touched, so that it is resident and giving it back frees real pages.
+  memset(_reserve, 0, _opts.reserve);
+  return true;
+}
+
+bool memory_controller::release_reserve() {
+  std::lock_guard<std::mutex> lk(_reserve_mtx);
+  if (!_reserve) {
+    return false;
+  }
+  free(_reserve);
+  _reserve = nullptr;
+  return true;
+}
+
+void memory_controller::new_handler() {
+  memory_controller *c = instance;
+  if (c && c->release_reserve()) {
+    // The allocation is retried on what the reserve gave back.
+    c->_starved = true;
+    c->_reserve_releases++;
+    return;
+  }
+  static const char msg[] = "Out of memory, and the reserve is used up\n";
+  write(2, msg, sizeof(msg) - 1);
+  std::abort();
+}
+
+memory_controller::sample memory_controller::read_sample() const {
+  return read_sample(_opts.statm, _cgroup_dir,
+                     "/proc/pressure/memory");
+}
+
+/* The first number after key in file, false if there is none */
+static bool read_field(const std::string &file, const char *key,
+                       const char *format, void *value) {
+  FILE *in = fopen(file.c_str(), "r");
+  if (!in) {
+    return false;
+  }
+  char line[4352];
+  bool found = false;
+  size_t key_len = strlen(key);
+  while (!found && fgets(line, sizeof(line), in)) {
+    found = strncmp(line, key, key_len) == 0 &&
+            sscanf(line + key_len, format, value) == 1;
+  }
+  fclose(in);
+  return found;
+}
+
+memory_controller::sample
+memory_controller::read_sample(const std::string &statm,
+                               const std::string &cgroup_dir,
+                               const std::string &global_pressure) {
+  sample s;
+  size_t size, resident, shared;
+  FILE *in = fopen(statm.c_str(), "r");
+  if (in) {
+    // Resident pages less the file backed ones, the mapped input among them.
+    if (fscanf(in, "%zu %zu %zu", &size, &resident, &shared) == 3) {
+      s.rss = (resident - std::min(resident, shared)) * getpagesize();
+    }
+    fclose(in);
+  }
+  std::string pressure = global_pressure;
+  if (!cgroup_dir.empty()) {
+    char max[32];
+    if (read_field(cgroup_dir + "/memory.max", "", "%31s", max) &&
+        strcmp(max, "max") != 0) {
+      s.cgroup_max = strtoull(max, nullptr, 10);
+    }
+    size_t inactive_file = 0;
+    read_field(cgroup_dir + "/memory.current", "", "%zu", &s.cgroup_current);
+    read_field(cgroup_dir + "/memory.stat", "inactive_file ", "%zu",
+               &inactive_file);
+    s.cgroup_current -= std::min(s.cgroup_current, inactive_file);
+    pressure = cgroup_dir + "/memory.pressure";
+  }
+  read_field(pressure, "some avg10=", "%lf", &s.pressure);
+  return s;
+}
+
+std::string memory_controller::find_cgroup(const std::string &proc_cgroup,
+                                           const std::string &mount) {
+  // Under cgroup v2 the line is "0::<path>".
+  char path[4096];
+  if (!read_field(proc_cgroup, "0::", "%4095s", path)) {
+    return "";
+  }
+  std::string dir = mount + (strcmp(path, "/") == 0 ? "" : path);
+  if (access((dir + "/memory.max").c_str(), R_OK) != 0 &&
+      access((dir + "/memory.current").c_str(), R_OK) != 0) {
+    return "";
+  }
+  return dir;
+}
+
+void memory_controller::print_stats(FILE *out) const {
+  fprintf(out,
+          "memory controller: %zu samples, peak rss %.1fM, lowest watermark "
+          "%.1fM, %zu sheds, reserve released %zu times\n",
+          _ticks.load(), mib(_peak_rss),
+          mib(_min_watermark == SIZE_MAX ? 0 : _min_watermark.load()),
+          _sheds.load(), _reserve_releases.load());
+}
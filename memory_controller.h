@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Keeps the process under its memory budget: the limit it was given, or less
+ * if its cgroup (v2) has less left for it. A thread samples what the kernel
+ * sees every interval: the anonymous RSS of the process, memory.max and
+ * memory.current of the cgroup, and the memory pressure (PSI). From that it
+ * moves the watermark of the memtables: down by whatever the process holds
+ * beyond its target, further down under pressure, which makes the owners
+ * flush sooner and then wait for the flushes. Past the target it also asks
+ * for memtables to be flushed right away.
+ *
+ * An emergency reserve is held from start() on. It goes back to malloc when
+ * the RSS closes in on the budget, or when an allocation fails, so that the
+ * flushes still find memory; nothing but that happens inside a failing
+ * allocation. */
+class memory_controller {
+public:
+  struct options {
+    size_t limit = SIZE_MAX;
+    /* The watermark the memtables get when there is room */
+    size_t watermark = SIZE_MAX;
+    size_t reserve = 16 * 1024 * 1024;
+    double interval = 0.05;
+    /* The share of time stalled on memory (PSI "some" avg10, in percent)
+     * from which the watermark shrinks */
+    double pressure_threshold = 10;
+    /* Where the RSS is read from */
+    std::string statm = "/proc/self/statm";
+  };
+
+  /* What the kernel says */
+  struct sample {
+    /* Anonymous resident bytes of this process */
+    size_t rss = 0;
+    /* SIZE_MAX if there is no limit */
+    size_t cgroup_max = SIZE_MAX;
+    /* memory.current of the whole cgroup, this process included, less the
+     * inactive file cache */
+    size_t cgroup_current = 0;
+    double pressure = 0;
+  };
+
+  /* What a sample makes of the budget */
+  struct decision {
+    size_t budget;
+    size_t watermark;
+    /* Bytes to flush right away */
+    size_t shed;
+    bool release_reserve;
+  };
+
+  /* The master side: set the watermark of the memtables, and flush about
+   * that many bytes of memtables. Every tick asks for the bytes to flush,
+   * 0 when there is nothing to flush. */
+  using set_watermark_fn = std::function<void(size_t)>;
+  using shed_fn = std::function<void(size_t)>;
+
+  memory_controller(options opts);
+
+  /* Stops the thread and gives the reserve back */
+  ~memory_controller();
+
+  /* Takes the reserve, installs the new_handler and starts sampling. */
+  void start(set_watermark_fn set_watermark, shed_fn shed);
+
+  void stop();
+
+  decision decide(const sample &s) const;
+
+  /* Reads the files of the kernel. The cgroup directory is found once, by
+   * find_cgroup(), empty if there is none. */
+  sample read_sample() const;
+
+  static sample read_sample(const std::string &statm,
+                            const std::string &cgroup_dir,
+                            const std::string &global_pressure);
+
+  /* The cgroup v2 directory of this process, under one of the usual mount
+   * points; empty if it has none or it cannot be read. */
+  static std::string find_cgroup(const std::string &proc_cgroup,
+                                 const std::string &mount);
+
+  void print_stats(FILE *out) const;
+
+private:
+  void worker();
+  void tick();
+  /* Takes the reserve if it is not held, false if malloc has nothing */
+  bool take_reserve();
+  /* Gives it back to malloc, false if it was not held */
+  bool release_reserve();
+  static void new_handler();
+
+  options _opts;
+  std::string _cgroup_dir;
+  set_watermark_fn _set_watermark;
+  shed_fn _shed;
+
+  std::mutex _reserve_mtx;
+  void *_reserve = nullptr;
+  /* An allocation failed, the next tick sheds as much as it can */
+  std::atomic<bool> _starved{false};
+
+  std::mutex _mtx;
+  std::condition_variable _cv;
+  bool _stopping = false;
+  std::thread _thread;
+
+  /* For --stats, only the thread writes them. */
+  std::atomic<size_t> _ticks{0};
+  std::atomic<size_t> _min_watermark{SIZE_MAX};
+  std::atomic<size_t> _peak_rss{0};
+  std::atomic<size_t> _sheds{0};
+  std::atomic<size_t> _reserve_releases{0};
+
+  static inline std::atomic<memory_controller *> instance{nullptr};
+};
@@ -0,0 +1,491 @@
+#pragma once
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "entry.h"
+#include "memusage_allocator.h"
+#include "types.h"
+
+/* Bump allocator for the url bytes of one memtable. Nothing is freed one by
+ * one, clear() drops all chunks at once. The chunks are counted by the
+ * memtable's memusage_counter. */
+class arena {
+public:
+  static constexpr size_t chunk_size = 64 * 1024;
+
+  arena(memusage_counter *usage) : _alloc(usage) {}
+
+  arena(arena &&other) noexcept
+      : _alloc(other._alloc), _chunks(std::exchange(other._chunks, nullptr)),
+        _cur(std::exchange(other._cur, nullptr)),
+        _left(std::exchange(other._left, 0)) {}
+
+  arena &operator=(arena &&other) noexcept {
+    clear();
+    _alloc = other._alloc;
+    _chunks = std::exchange(other._chunks, nullptr);
+    _cur = std::exchange(other._cur, nullptr);
+    _left = std::exchange(other._left, 0);
+    return *this;
+  }
+
+  ~arena() { clear(); }
+
+  char *allocate(size_t n) {
+    if (n > _left) {
+      size_t size = std::max(n, chunk_size);
+      // The chunks are chained through their first bytes.
+      char *chunk = _alloc.allocate(sizeof(char *) + size);
+      memcpy(chunk, &_chunks, sizeof(char *));
+      _chunks = chunk;
+      _cur = chunk + sizeof(char *);
+      _left = size;
+    }
+    char *ret = _cur;
+    _cur += n;
+    _left -= n;
+    return ret;
+  }
+
+  /* Bytes the next allocation of n bytes would take */
+  size_t growth(size_t n) const {
+    if (n <= _left) {
+      return 0;
+    }
+    return alloc_type::footprint(sizeof(char *) + std::max(n, chunk_size));
+  }
+
+  void clear() {
+    while (_chunks) {
+      char *next;
+      memcpy(&next, _chunks, sizeof(char *));
+      _alloc.deallocate(_chunks, 0);
+      _chunks = next;
+    }
+    _cur = nullptr;
+    _left = 0;
+  }
+
+private:
+  using alloc_type = memusage_allocator<char>;
+
+  alloc_type _alloc;
+  char *_chunks = nullptr;
+  char *_cur = nullptr;
+  size_t _left = 0;
+};
+
+/* Open addressing (linear probing) hash table from url to count. Every slot
+ * keeps the hash of its url, which probing compares first and which the SST
+ * runs are ordered by. The url bytes live in an arena. The entries are only
+ * sorted once, by sorted(), right before the table is flushed. All the memory
+ * goes through memusage_allocators, so mem_usage() is what malloc handed out
+ * rather than an estimate.
+ *
+ * The urls of a shard come from far fewer hosts than there are urls, so the
+ * "scheme://host" of a url is interned: the arena keeps every host once, and
+ * a key is the rest of the url. The id of the host sits in the top bits of
+ * the count of the slot, so that no key pays for it. Id 0 is a key without a
+ * host, stored whole. Keys are only put together again for the caller, by
+ * for_each() and by the iterators of sorted(). */
+class memtable {
+public:
+  using entry_type = entry<slice_url_t>;
+
+  /* The entries in (hash, url) order. An entry, and its url, is only valid
+   * until its iterator moves. */
+  class sorted_view {
+  public:
+    class iterator {
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = entry_type;
+      using difference_type = ptrdiff_t;
+      using pointer = const entry_type *;
+      using reference = const entry_type &;
+
+      iterator() = default;
+      iterator(const memtable *table, const entry_type *slot)
+          : _table(table), _slot(slot) {}
+
+      reference operator*() const {
+        _cur = _table->expand(*_slot, _buf);
+        return _cur;
+      }
+
+      pointer operator->() const { return &**this; }
+
+      iterator &operator++() {
+        ++_slot;
+        return *this;
+      }
+
+      iterator &operator--() {
+        --_slot;
+        return *this;
+      }
+
+      iterator &operator+=(difference_type n) {
+        _slot += n;
+        return *this;
+      }
+
+      difference_type operator-(const iterator &rhs) const {
+        return _slot - rhs._slot;
+      }
+
+      bool operator==(const iterator &rhs) const { return _slot == rhs._slot; }
+
+      bool operator!=(const iterator &rhs) const { return _slot != rhs._slot; }
+
+    private:
+      const memtable *_table = nullptr;
+      const entry_type *_slot = nullptr;
+      mutable std::string _buf;
+      mutable entry_type _cur;
+    };
+
+    sorted_view(const memtable *table, const entry_type *first,
+                const entry_type *last)
+        : _table(table), _first(first), _last(last) {}
+
+    iterator begin() const { return {_table, _first}; }
+    iterator end() const { return {_table, _last}; }
+
+  private:
+    const memtable *_table;
+    const entry_type *_first, *_last;
+  };
+
+  static constexpr size_t initial_capacity = 256;
+  /* Hosts past that many are not interned any more. */
+  static constexpr size_t max_hosts = UINT16_MAX;
+
+  memtable()
+      : _usage(std::make_unique<memusage_counter>()), _arena(_usage.get()),
+        _hosts(empty_hosts(_usage.get())),
+        _host_ids(empty_host_ids(_usage.get())) {}
+
+  /* Leaves other empty, so a full table can be frozen and replaced. The
+   * counter goes along with the memory it counts. */
+  memtable(memtable &&other)
+      : _usage(std::exchange(other._usage,
+                             std::make_unique<memusage_counter>())),
+        _entries(std::exchange(other._entries, nullptr)),
+        _capacity(std::exchange(other._capacity, 0)),
+        _bits(std::exchange(other._bits, 0)),
+        _size(std::exchange(other._size, 0)),
+        _sorted(std::exchange(other._sorted, false)),
+        _arena(std::exchange(other._arena, arena(other._usage.get()))),
+        _hosts(std::exchange(other._hosts,
+                             empty_hosts(other._usage.get()))),
+        _host_ids(std::exchange(other._host_ids,
+                                empty_host_ids(other._usage.get()))) {}
+
+  ~memtable() { clear(); }
+
+  /* Counts one more occurrence of url if it is already in the table. */
+  bool increment(slice_url_t url, size_t hash) {
+    size_t i = find(url, hash);
+    if (i == npos) {
+      return false;
+    }
+    assert((_entries[i].count & count_mask) < count_mask);
+    _entries[i].count++;
+    return true;
+  }
+
+  bool contains(slice_url_t url, size_t hash) const {
+    return find(url, hash) != npos;
+  }
+
+  /* The count of url, 0 if it is not in the table */
+  count_t count_of(slice_url_t url, size_t hash) const {
+    size_t i = find(url, hash);
+    return i == npos ? 0 : _entries[i].count & count_mask;
+  }
+
+  /* Calls f on every entry, in slot order. The url of an entry is only
+   * valid during the call. */
+  template <typename F> void for_each(F &&f) const {
+    std::string buf;
+    for (size_t i = 0; i < _capacity; i++) {
+      if (_entries[i].hash != 0) {
+        f(expand(_entries[i], buf));
+      }
+    }
+  }
+
+  /* Adds url, which must not be in the table yet. */
+  void insert(slice_url_t url, size_t hash, count_t count = 1) {
+    assert(!_sorted);
+    assert(count <= count_mask);
+    if (needs_grow()) {
+      rehash(_capacity ? _capacity * 2 : initial_capacity);
+    }
+    hash = hash ? hash : 1;
+    size_t mask = _capacity - 1;
+    size_t i = index_of(hash);
+    while (_entries[i].hash != 0) {
+      i = (i + 1) & mask;
+    }
+    slice_url_t host = host_of(url);
+    uint16_t id = host.empty() ? 0 : intern(host);
+    slice_url_t rest = id ? url.substr(host.size()) : url;
+    char *key = _arena.allocate(rest.size());
+    memcpy(key, rest.data(), rest.size());
+    _entries[i] = {slice_url_t(key, rest.size()),
+                   (count_t)id << id_shift | count, hash};
+    _size++;
+  }
+
+  /* Upper bound of the bytes that adding a new url might allocate, in the
+   * footprint() the counter records */
+  size_t growth(slice_url_t url) const {
+    size_t bytes = 0;
+    if (needs_grow()) {
+      size_t slots = _capacity ? _capacity * 2 : initial_capacity;
+      bytes += slot_alloc_type::footprint(slots * slot_size);
+    }
+    size_t key = url.size();
+    slice_url_t host = host_of(url);
+    if (!host.empty() && _hosts.size() < max_hosts &&
+        _host_ids.find(host) == _host_ids.end()) {
+      // A new host goes to the arena too, and takes a node in _host_ids.
+      key += host.size();
+      bytes += host_node_footprint();
+      if (_hosts.size() == _hosts.capacity()) {
+        bytes += host_alloc_type::footprint(
+            std::max(2 * _hosts.capacity(), (size_t)1) * sizeof(slice_url_t));
+      }
+      // libstdc++ moves to the prime after twice the buckets, 13 at first.
+      if (_host_ids.empty() ||
+          _host_ids.size() + 1 >
+              _host_ids.bucket_count() * _host_ids.max_load_factor()) {
+        bytes += host_alloc_type::footprint(
+            std::max(3 * _host_ids.bucket_count(), (size_t)16) *
+            sizeof(void *));
+      }
+    }
+    return bytes + _arena.growth(key);
+  }
+
+  /* Sorts the entries by (hash, url) in place. After that the table can only
+   * be cleared. */
+  sorted_view sorted() {
+    size_t n = 0;
+    for (size_t i = 0; i < _capacity; i++) {
+      if (_entries[i].hash != 0) {
+        _entries[n++] = _entries[i];
+      }
+    }
+    assert(n == _size);
+    // Equal hashes are rare, only they need the urls put together.
+    std::string lhs_buf, rhs_buf;
+    std::sort(_entries, _entries + n,
+              [&](const entry_type &lhs, const entry_type &rhs) {
+                if (lhs.hash != rhs.hash) {
+                  return lhs.hash < rhs.hash;
+                }
+                return expand(lhs, lhs_buf).url < expand(rhs, rhs_buf).url;
+              });
+    _sorted = true;
+    return {this, _entries, _entries + n};
+  }
+
+  /* Releases all memory, the arena goes away chunk by chunk rather than entry
+   * by entry. */
+  void clear() {
+    if (_entries) {
+      slot_alloc().deallocate(_entries, _capacity);
+      _entries = nullptr;
+    }
+    _arena.clear();
+    // Swapped out, so that the containers give their memory back.
+    empty_hosts(_usage.get()).swap(_hosts);
+    empty_host_ids(_usage.get()).swap(_host_ids);
+    _capacity = 0;
+    _size = 0;
+    _sorted = false;
+  }
+
+  size_t size() const { return _size; }
+
+  bool empty() const { return _size == 0; }
+
+  /* The hosts that are interned */
+  size_t n_hosts() const { return _hosts.size(); }
+
+  /* The slots, the arena chunks and the host dictionary, as malloc sees
+   * them */
+  size_t mem_usage() const { return _usage->bytes; }
+
+private:
+  using slot_alloc_type = memusage_allocator<entry_type>;
+  using host_alloc_type = memusage_allocator<slice_url_t>;
+  using host_list = std::vector<slice_url_t, host_alloc_type>;
+  using host_map =
+      std::unordered_map<slice_url_t, uint16_t, std::hash<slice_url_t>,
+                         std::equal_to<slice_url_t>,
+                         memusage_allocator<std::pair<const slice_url_t,
+                                                      uint16_t>>>;
+  static constexpr size_t slot_size = sizeof(entry_type);
+  /* The count of a slot keeps the id of its host above that bit. */
+  static constexpr int id_shift = 48;
+  static constexpr count_t count_mask = ((count_t)1 << id_shift) - 1;
+  static constexpr size_t npos = SIZE_MAX;
+
+  static host_list empty_hosts(memusage_counter *usage) {
+    return host_list(host_alloc_type(usage));
+  }
+
+  static host_map empty_host_ids(memusage_counter *usage) {
+    return host_map(host_map::allocator_type(usage));
+  }
+
+  /* The most a new host takes in _host_ids, measured once on a map of its
+   * own */
+  static size_t host_node_footprint() {
+    static const size_t bytes = [] {
+      memusage_counter usage;
+      host_map ids = empty_host_ids(&usage);
+      ids.reserve(1);
+      size_t before = usage.bytes;
+      ids.emplace(slice_url_t("http://x"), 1);
+      return usage.bytes - before + host_alloc_type::unsplit_slack;
+    }();
+    return bytes;
+  }
+
+  /* The "scheme://host" a url starts with, empty if it does not start with
+   * a scheme, that is [A-Za-z][A-Za-z0-9+.-]* */
+  static slice_url_t host_of(slice_url_t url) {
+    if (url.empty() || !isalpha((unsigned char)url[0])) {
+      return {};
+    }
+    size_t scheme = 1;
+    while (scheme < url.size() &&
+           (isalnum((unsigned char)url[scheme]) || url[scheme] == '+' ||
+            url[scheme] == '.' || url[scheme] == '-')) {
+      scheme++;
+    }
+    if (url.compare(scheme, 3, "://") != 0) {
+      return {};
+    }
+    return url.substr(0, url.find('/', scheme + 3));
+  }
+
+  /* The id of host, 0 if there is no room for another one */
+  uint16_t intern(slice_url_t host) {
+    auto it = _host_ids.find(host);
+    if (it != _host_ids.end()) {
+      return it->second;
+    }
+    if (_hosts.size() == max_hosts) {
+      return 0;
+    }
+    char *bytes = _arena.allocate(host.size());
+    memcpy(bytes, host.data(), host.size());
+    _hosts.emplace_back(bytes, host.size());
+    uint16_t id = _hosts.size();
+    _host_ids.emplace(_hosts.back(), id);
+    return id;
+  }
+
+  static uint16_t host_id(const entry_type &slot) {
+    return slot.count >> id_shift;
+  }
+
+  /* The slot with its whole url, which is put together in buf if it has to. */
+  entry_type expand(const entry_type &slot, std::string &buf) const {
+    uint16_t id = host_id(slot);
+    count_t count = slot.count & count_mask;
+    if (id == 0) {
+      return {slot.url, count, slot.hash};
+    }
+    const slice_url_t &host = _hosts[id - 1];
+    buf.assign(host.data(), host.size());
+    buf.append(slot.url.data(), slot.url.size());
+    return {slice_url_t(buf), count, slot.hash};
+  }
+
+  /* Whether the url of slot is url, without putting it together */
+  bool matches(const entry_type &slot, slice_url_t url) const {
+    uint16_t id = host_id(slot);
+    const slice_url_t &rest = slot.url;
+    if (id == 0) {
+      return rest == url;
+    }
+    const slice_url_t &host = _hosts[id - 1];
+    return host.size() + rest.size() == url.size() &&
+           memcmp(host.data(), url.data(), host.size()) == 0 &&
+           memcmp(rest.data(), url.data() + host.size(), rest.size()) == 0;
+  }
+
+  size_t find(slice_url_t url, size_t hash) const {
+    if (_size == 0) {
+      return npos;
+    }
+    hash = hash ? hash : 1; // 0 marks an empty slot
+    size_t mask = _capacity - 1;
+    for (size_t i = index_of(hash); _entries[i].hash != 0; i = (i + 1) & mask) {
+      if (_entries[i].hash == hash && matches(_entries[i], url)) {
+        return i;
+      }
+    }
+    return npos;
+  }
+
+  bool needs_grow() const { return (_size + 1) * 4 > _capacity * 3; }
+
+  /* Fibonacci hashing, the low bits of the hash also pick the shard. */
+  size_t index_of(size_t hash) const {
+    return (hash * 0x9E3779B97F4A7C15ull) >> (64 - _bits);
+  }
+
+  slot_alloc_type slot_alloc() const { return slot_alloc_type(_usage.get()); }
+
+  void rehash(size_t capacity) {
+    entry_type *entries = _entries;
+    size_t old_capacity = _capacity;
+    _entries = slot_alloc().allocate(capacity);
+    std::uninitialized_value_construct_n(_entries, capacity);
+    _capacity = capacity;
+    _bits = __builtin_ctzll(capacity);
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (entries[i].hash == 0) {
+        continue;
+      }
+      size_t j = index_of(entries[i].hash);
+      while (_entries[j].hash != 0) {
+        j = (j + 1) & (capacity - 1);
+      }
+      _entries[j] = entries[i];
+    }
+    if (entries) {
+      slot_alloc().deallocate(entries, old_capacity);
+    }
+  }
+
+  /* Declared first, everything below counts into it. */
+  std::unique_ptr<memusage_counter> _usage;
+  entry_type *_entries = nullptr;
+  size_t _capacity = 0;
+  size_t _bits = 0;
+  size_t _size = 0;
+  bool _sorted = false;
+  arena _arena;
+  /* The interned hosts, id i is _hosts[i - 1]. */
+  host_list _hosts;
+  host_map _host_ids;
+};
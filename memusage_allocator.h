@@ -1,7 +1,23 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <new>
+#include <type_traits>
 
-static size_t memory_usage;
+#include <malloc.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/* The bytes held through a set of memusage_allocators, as malloc sees them.
+ * One memtable counts into one of these. Atomic, since the default counter
+ * is shared by every thread, and a table is read by others than its owner. */
+struct memusage_counter {
+  std::atomic<size_t> bytes{0};
+};
+
+/* Allocators that were not given a counter count here */
+inline memusage_counter default_memusage_counter;
 
 template <typename T> struct memusage_allocator {
 public:
@@ -15,51 +31,75 @@ public:
 
   template <class U> struct rebind { typedef memusage_allocator<U> other; };
 
-  pointer address(reference value) const { return &value; }
-  const_pointer address(const_reference value) const { return &value; }
+  /* Containers that are moved or swapped take the counter of their memory
+   * along. */
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
 
-  memusage_allocator() : base() {}
-  memusage_allocator(const memusage_allocator &) : base() {}
+  memusage_allocator(memusage_counter *c = &default_memusage_counter)
+      : counter(c) {}
   template <typename U>
-  memusage_allocator(const memusage_allocator<U> &) : base() {}
-  ~memusage_allocator() {}
+  memusage_allocator(const memusage_allocator<U> &other)
+      : counter(other.counter) {}
 
   // return maximum number of elements that can be allocated
-  size_type max_size() const throw() { return base.max_size(); }
+  size_type max_size() const throw() { return SIZE_MAX / sizeof(T); }
+
+  pointer allocate(size_type num, const void * = 0) {
+    // Through operator new, so that the new_handler can still flush.
+    pointer p = static_cast<pointer>(::operator new(num * sizeof(T)));
+    counter->bytes.fetch_add(footprint(p), std::memory_order_relaxed);
+    return p;
+  }
 
-  pointer allocate(size_type num, const void *p = 0) {
-    memory_usage += num * sizeof(T);
-    return base.allocate(num, p);
+  // deallocate storage p of deleted elements
+  void deallocate(pointer p, size_type) {
+    counter->bytes.fetch_sub(footprint(p), std::memory_order_relaxed);
+    ::operator delete(p);
   }
 
-  void construct(pointer p, const T &value) { return base.construct(p, value); }
+  /* What the block at p really takes: the usable size, which includes the
+   * rounding to a size class or to pages, and the chunk header. */
+  static size_t footprint(const void *p) {
+    return malloc_usable_size(const_cast<void *>(p)) + sizeof(size_t);
+  }
 
-  // destroy elements of initialized storage p
-  void destroy(pointer p) { base.destroy(p); }
+  /* malloc hands out a whole free chunk when what would be left of it is
+   * smaller than a chunk can be, so a block takes up to that much more than
+   * its size class. */
+  static constexpr size_t unsplit_slack = 4 * sizeof(size_t);
 
-  // deallocate storage p of deleted elements
-  void deallocate(pointer p, size_type num) {
-    memory_usage -= num * sizeof(T);
-    base.deallocate(p, num);
+  /* The most footprint() of a request of n bytes can be, before it is made.
+   * malloc is asked for a block of that size, so this costs an allocation. */
+  static size_t footprint(size_t n) {
+    void *p = malloc(n);
+    if (!p) {
+      return n + sizeof(size_t) + unsplit_slack;
+    }
+    size_t bytes = footprint(p);
+    free(p);
+    return bytes + unsplit_slack;
   }
-  std::allocator<T> base;
+
+  memusage_counter *counter;
 };
 
-// for our purposes, we don't want to distinguish between allocators.
 template <class T1, class T2>
-bool operator==(const memusage_allocator<T1> &, const T2 &) throw() {
-  return true;
+bool operator==(const memusage_allocator<T1> &lhs,
+                const memusage_allocator<T2> &rhs) throw() {
+  return lhs.counter == rhs.counter;
 }
 
 template <class T1, class T2>
-bool operator!=(const memusage_allocator<T1> &, const T2 &) throw() {
-  return false;
+bool operator!=(const memusage_allocator<T1> &lhs,
+                const memusage_allocator<T2> &rhs) throw() {
+  return !(lhs == rhs);
 }
 
 struct memusage_measure_guard {
-  memusage_measure_guard() { memory_usage = 0; }
+  memusage_measure_guard() { default_memusage_counter.bytes = 0; }
 
-  size_t current_usage() { return memory_usage; }
+  size_t current_usage() { return default_memusage_counter.bytes.load(); }
 
-  ~memusage_measure_guard() { memory_usage = 0; }
-};
\ No newline at end of file
+  ~memusage_measure_guard() { default_memusage_counter.bytes = 0; }
+};
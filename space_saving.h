@@ -0,0 +1,146 @@
+#pragma once
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <assert.h>
+
+#include "types.h"
+
+/* Space-Saving heavy hitters summary (Metwally et al.) with a fixed number of
+ * counters. A counter over-estimates the count of its url by at most error,
+ * and every url seen more than total() / capacity times has a counter. */
+class space_saving {
+public:
+  struct counter {
+    owned_url_t url;
+    size_t hash;
+    count_t count;
+    count_t error;
+  };
+
+  space_saving(size_t capacity) : _capacity(capacity) {
+    assert(capacity != 0);
+    // The index points into the urls, so the counters must never move.
+    _counters.reserve(capacity);
+    _heap.reserve(capacity);
+    _heap_pos.reserve(capacity);
+    _index.reserve(capacity);
+  }
+
+  // Copies would keep pointing into the urls of the original.
+  space_saving(const space_saving &) = delete;
+  space_saving(space_saving &&) = default;
+
+  void add(slice_url_t url, size_t hash, count_t weight = 1) {
+    _total += weight;
+    auto it = _index.find({url, hash});
+    if (it != _index.end()) {
+      _counters[it->second].count += weight;
+      sift_down(_heap_pos[it->second]);
+    } else if (_counters.size() < _capacity) {
+      size_t c = _counters.size();
+      _counters.push_back({owned_url_t(url), hash, weight, 0});
+      _index.emplace(hashed_url{_counters[c].url, hash}, c);
+      _heap.push_back(c);
+      _heap_pos.push_back(_heap.size() - 1);
+      sift_up(_heap.size() - 1);
+    } else {
+      // Take over the smallest counter, its count bounds the error.
+      // Reuse the node of the index, the tail of the stream ends up here.
+      auto &min = _counters[_heap[0]];
+      auto node = _index.extract({min.url, min.hash});
+      min.url.assign(url);
+      min.hash = hash;
+      min.error = min.count;
+      min.count += weight;
+      node.key() = {min.url, hash};
+      _index.insert(std::move(node));
+      sift_down(0);
+    }
+  }
+
+  const counter *find(slice_url_t url, size_t hash) const {
+    auto it = _index.find({url, hash});
+    return it == _index.end() ? nullptr : &_counters[it->second];
+  }
+
+  const std::vector<counter> &counters() const { return _counters; }
+
+  /* The sum of all the weights added so far */
+  count_t total() const { return _total; }
+
+  /* The smallest count, no url without a counter was seen more often. */
+  count_t min_count() const {
+    return _counters.size() < _capacity ? 0 : _counters[_heap[0]].count;
+  }
+
+  size_t mem_usage() const {
+    size_t usage = _capacity * counter_overhead();
+    for (const auto &c : _counters) {
+      usage += c.url.capacity();
+    }
+    return usage;
+  }
+
+  /* Bytes per counter, not counting the url itself */
+  static constexpr size_t counter_overhead() {
+    // counter, heap slots, bucket and node of the index
+    return sizeof(counter) + 2 * sizeof(size_t) + sizeof(void *) +
+           sizeof(hashed_url) + 2 * sizeof(size_t);
+  }
+
+private:
+  struct hashed_url {
+    slice_url_t url;
+    size_t hash;
+    bool operator==(const hashed_url &rhs) const { return url == rhs.url; }
+  };
+
+  struct hashed_url_hasher {
+    size_t operator()(const hashed_url &h) const { return h.hash; }
+  };
+
+  bool less(size_t i, size_t j) {
+    return _counters[_heap[i]].count < _counters[_heap[j]].count;
+  }
+
+  void swap_nodes(size_t i, size_t j) {
+    std::swap(_heap[i], _heap[j]);
+    _heap_pos[_heap[i]] = i;
+    _heap_pos[_heap[j]] = j;
+  }
+
+  void sift_up(size_t i) {
+    while (i > 0 && less(i, (i - 1) / 2)) {
+      swap_nodes(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  /* Counts only grow, so a counter can only move down the min-heap. */
+  void sift_down(size_t i) {
+    while (true) {
+      size_t smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+      if (l < _heap.size() && less(l, smallest)) {
+        smallest = l;
+      }
+      if (r < _heap.size() && less(r, smallest)) {
+        smallest = r;
+      }
+      if (smallest == i) {
+        return;
+      }
+      swap_nodes(i, smallest);
+      i = smallest;
+    }
+  }
+
+  size_t _capacity;
+  count_t _total = 0;
+  std::vector<counter> _counters;
+  /* Min-heap of counter indexes, and the position of each counter in it */
+  std::vector<size_t> _heap;
+  std::vector<size_t> _heap_pos;
+  std::unordered_map<hashed_url, size_t, hashed_url_hasher> _index;
+};
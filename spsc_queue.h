@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include <assert.h>
+#include <stddef.h>
+
+/* Bounded lock-free queue, safe for exactly one producer thread and one
+ * consumer thread. Each side caches the other side's index, so the shared
+ * cache lines are only touched when the queue looks full or empty. */
+template <typename T> class spsc_queue {
+public:
+  static constexpr size_t cache_line = 64;
+
+  spsc_queue(size_t capacity)
+      : _size(capacity + 1), _slots(std::make_unique<T[]>(capacity + 1)) {
+    assert(capacity != 0);
+  }
+
+  /* Only moves from v when the push succeeds. */
+  bool try_push(T &&v) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t next = advance(tail);
+    if (next == _head_cache) {
+      _head_cache = _head.load(std::memory_order_acquire);
+      if (next == _head_cache) {
+        return false;
+      }
+    }
+    _slots[tail] = std::move(v);
+    _tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T &v) {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail_cache) {
+      _tail_cache = _tail.load(std::memory_order_acquire);
+      if (head == _tail_cache) {
+        return false;
+      }
+    }
+    v = std::move(_slots[head]);
+    _head.store(advance(head), std::memory_order_release);
+    return true;
+  }
+
+private:
+  size_t advance(size_t i) { return i + 1 == _size ? 0 : i + 1; }
+
+  const size_t _size;
+  std::unique_ptr<T[]> _slots;
+  /* consumer side */
+  alignas(cache_line) std::atomic<size_t> _head{0};
+  size_t _tail_cache = 0;
+  /* producer side */
+  alignas(cache_line) std::atomic<size_t> _tail{0};
+  size_t _head_cache = 0;
+};
@@ -0,0 +1,218 @@
+#pragma once
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "codec.h"
+#include "types.h"
+
+/* SST file layout (version 4):
+ *
+ *   header: "TSST" u32 version, u32 codec id
+ *   block*: u32 size, u32 raw size, then size bytes that the codec turns
+ *           into raw size bytes of
+ *             entry*: varint shared, varint non_shared, varint count,
+ *                     u64 hash, non_shared key bytes
+ *             trailer: u32 restart offsets[n], u32 n
+ *   index:  per block: u64 offset of the block, u64 hash of its first entry
+ *   footer: u64 index offset, u64 blocks, u64 entries, u64 min hash,
+ *           u64 max hash, "TSST"
+ *
+ * Entries are sorted by (hash, key), see key_less. Keys share their prefix
+ * with the previous key in the block, except at the restart points (every
+ * restart_interval keys), which store the whole key. The index is sparse, one
+ * key per block, and the restart offsets of a block index it in turn: a seek
+ * to a hash binary searches both, and decodes at most restart_interval keys
+ * before it. A block that the codec does not make smaller is stored raw, with
+ * size == raw size. All fixed width integers are little endian. */
+namespace sst {
+constexpr char magic[4] = {'T', 'S', 'S', 'T'};
+constexpr uint32_t version = 4;
+constexpr size_t header_size = sizeof(magic) + 2 * sizeof(uint32_t);
+constexpr size_t block_header_size = 2 * sizeof(uint32_t);
+constexpr size_t index_entry_size = 2 * sizeof(uint64_t);
+constexpr size_t footer_size = 5 * sizeof(uint64_t) + sizeof(magic);
+constexpr size_t block_size = 4096;
+constexpr size_t restart_interval = 16;
+
+inline void put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+/* Returns the position after the varint, or nullptr if it is truncated. */
+inline const char *get_varint(const char *p, const char *limit, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 64 && p < limit; shift += 7) {
+    uint64_t byte = (unsigned char)*p++;
+    v |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+/* Little endian whatever the host is. The compilers turn the shifts into
+ * plain loads and stores on a little endian one. */
+inline void put_fixed32(std::string &out, uint32_t v) {
+  char buf[sizeof(v)];
+  for (size_t i = 0; i < sizeof(v); i++) {
+    buf[i] = (char)(v >> (8 * i));
+  }
+  out.append(buf, sizeof(v));
+}
+
+inline uint32_t get_fixed32(const char *p) {
+  uint32_t v = 0;
+  for (size_t i = 0; i < sizeof(v); i++) {
+    v |= (uint32_t)(unsigned char)p[i] << (8 * i);
+  }
+  return v;
+}
+
+inline void put_fixed64(std::string &out, uint64_t v) {
+  char buf[sizeof(v)];
+  for (size_t i = 0; i < sizeof(v); i++) {
+    buf[i] = (char)(v >> (8 * i));
+  }
+  out.append(buf, sizeof(v));
+}
+
+inline uint64_t get_fixed64(const char *p) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < sizeof(v); i++) {
+    v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+  }
+  return v;
+}
+} // namespace sst
+
+void die(const char *fmt, ...);
+
+/* Writes entries in (hash, url) order into the blocks of one SST file,
+ * compressed by c. Dies if the file cannot be written, a short run would only
+ * turn up as a corrupted one when it is read back. */
+class sst_writer {
+public:
+  sst_writer(FILE *output, const codec *c = codec::none())
+      : _output(output), _codec(c) {
+    std::string header(sst::magic, sizeof(sst::magic));
+    sst::put_fixed32(header, sst::version);
+    sst::put_fixed32(header, c->id());
+    fwrite(header.data(), 1, header.size(), output);
+    check();
+  }
+
+  void add(slice_url_t url, count_t count, size_t hash) {
+    size_t shared = 0;
+    if (_n_entries == 0) {
+      sst::put_fixed64(_index, _offset);
+      sst::put_fixed64(_index, hash);
+    }
+    if (_total_entries++ == 0) {
+      _min_hash = hash;
+    }
+    _max_hash = hash;
+    if (_n_entries % sst::restart_interval == 0) {
+      sst::put_fixed32(_restarts, _block.size());
+    } else {
+      size_t limit = std::min(url.size(), _last_url.size());
+      while (shared < limit && url[shared] == _last_url[shared]) {
+        shared++;
+      }
+    }
+    sst::put_varint(_block, shared);
+    sst::put_varint(_block, url.size() - shared);
+    sst::put_varint(_block, count);
+    sst::put_fixed64(_block, hash);
+    _block.append(url.data() + shared, url.size() - shared);
+    _last_url.assign(url);
+    _n_entries++;
+    if (_block.size() >= sst::block_size) {
+      flush_block();
+    }
+  }
+
+  void finish() {
+    flush_block();
+    std::string footer;
+    sst::put_fixed64(footer, _offset);
+    sst::put_fixed64(footer, _index.size() / sst::index_entry_size);
+    sst::put_fixed64(footer, _total_entries);
+    sst::put_fixed64(footer, _min_hash);
+    sst::put_fixed64(footer, _max_hash);
+    footer.append(sst::magic, sizeof(sst::magic));
+    fwrite(_index.data(), 1, _index.size(), _output);
+    fwrite(footer.data(), 1, footer.size(), _output);
+    if (fflush(_output) != 0) {
+      die("Cannot write the sst, err: %s\n", strerror(errno));
+    }
+    check();
+  }
+
+private:
+  void check() {
+    if (ferror(_output)) {
+      die("Cannot write the sst, err: %s\n", strerror(errno));
+    }
+  }
+
+  void flush_block() {
+    if (_n_entries == 0) {
+      return;
+    }
+    _block.append(_restarts);
+    sst::put_fixed32(_block, _restarts.size() / sizeof(uint32_t));
+    const std::string *stored = &_block;
+    if (_codec->id() != codec::none()->id()) {
+      _compressed.clear();
+      _codec->compress(_block.data(), _block.size(), _compressed);
+      if (!_compressed.empty() && _compressed.size() < _block.size()) {
+        stored = &_compressed;
+      }
+    }
+    std::string sizes;
+    sst::put_fixed32(sizes, stored->size());
+    sst::put_fixed32(sizes, _block.size());
+    fwrite(sizes.data(), 1, sizes.size(), _output);
+    fwrite(stored->data(), 1, stored->size(), _output);
+    check();
+    _offset += sizes.size() + stored->size();
+    _block.clear();
+    _restarts.clear();
+    _n_entries = 0;
+  }
+
+  FILE *_output;
+  const codec *_codec;
+  std::string _block;
+  std::string _compressed;
+  std::string _restarts;
+  std::string _last_url;
+  /* In the current block */
+  size_t _n_entries = 0;
+  std::string _index;
+  size_t _offset = sst::header_size;
+  size_t _total_entries = 0;
+  size_t _min_hash = 0;
+  size_t _max_hash = 0;
+};
+
+/* Writes entries sorted by key_less, sst_read_iter reads them back. */
+template <typename Entries>
+void write_sst(const Entries &entries, FILE *output,
+               const codec *c = codec::none()) {
+  sst_writer writer(output, c);
+  for (const auto &e : entries) {
+    writer.add(e.url, e.count, e.hash);
+  }
+  writer.finish();
+}
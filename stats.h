@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <stddef.h>
+
+/* A counter with a single writer. The writer skips the locked add, a reader
+ * on another thread may see a slightly old value. */
+class relaxed_counter {
+public:
+  void add(size_t n) {
+    _value.store(_value.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  size_t get() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<size_t> _value{0};
+};
+
+/* What one ingest thread did, on a cache line of its own. A reader counts
+ * the lines it split, an owner the urls it counted. */
+struct alignas(64) ingest_counters {
+  relaxed_counter urls;
+  relaxed_counter bytes;
+};
+
+/* What merge_worker did for one shard */
+struct merge_stats {
+  size_t fan_in = 0;
+  /* Key ranges merged side by side */
+  size_t ranges = 0;
+  size_t entries = 0;
+  size_t distinct = 0;
+  size_t bytes = 0;
+  double seconds = 0;
+};
+
+/* Counters and timers of a master, reported by --stats. The hot paths only
+ * touch the counters of their own thread. */
+struct master_stats {
+  enum phase { ingest, drain, merge, n_phases };
+  static constexpr const char *phase_names[n_phases] = {"ingest", "drain",
+                                                        "merge"};
+
+  using clock = std::chrono::steady_clock;
+
+  std::vector<ingest_counters> readers;
+  std::vector<ingest_counters> owners;
+  /* Memtables written by the flush tasks */
+  std::atomic<size_t> flushes{0};
+  std::atomic<size_t> flush_bytes{0};
+  std::atomic<size_t> compactions{0};
+  std::atomic<size_t> checkpoints{0};
+  /* Memtables frozen because the memory_controller asked for it */
+  std::atomic<size_t> shed_bytes{0};
+  /* The highest memory usage the master accounted for */
+  std::atomic<size_t> peak_mem_usage{0};
+  std::vector<merge_stats> merges;
+
+  std::atomic<int> current_phase{ingest};
+  clock::time_point started = clock::now();
+  clock::time_point phase_started[n_phases];
+  double phase_seconds[n_phases] = {};
+
+  master_stats(size_t n_readers, size_t n_owners, size_t n_shards)
+      : readers(n_readers), owners(n_owners), merges(n_shards) {}
+
+  void begin_phase(phase p) {
+    phase_started[p] = clock::now();
+    current_phase = p;
+  }
+
+  void end_phase(phase p) {
+    std::chrono::duration<double> elapsed = clock::now() - phase_started[p];
+    phase_seconds[p] += elapsed.count();
+  }
+
+  static size_t sum(const std::vector<ingest_counters> &counters,
+                    relaxed_counter ingest_counters::*field) {
+    size_t total = 0;
+    for (const auto &c : counters) {
+      total += (c.*field).get();
+    }
+    return total;
+  }
+
+  void observe_mem_usage(size_t usage) {
+    size_t peak = peak_mem_usage.load(std::memory_order_relaxed);
+    while (usage > peak && !peak_mem_usage.compare_exchange_weak(
+                               peak, usage, std::memory_order_relaxed)) {
+    }
+  }
+};
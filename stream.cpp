@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <functional>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iterator.h"
+#include "stream.h"
+
+void die(const char *fmt, ...);
+
+bool window_length::parse(const char *text, window_length &result) {
+  char *end;
+  unsigned long long length = strtoull(text, &end, 10);
+  if (end == text || length == 0) {
+    return false;
+  }
+  if (*end == 's' && end[1] == '\0') {
+    result = {seconds, (size_t)length};
+    return true;
+  }
+  if (*end == '\0') {
+    result = {lines, (size_t)length};
+    return true;
+  }
+  return false;
+}
+
+stream_master::stream_master(int fd, window_length window,
+                             window_length slide, double emit_interval,
+                             size_t top_k, size_t n_shards, FILE *output)
+    : _fd(fd), _slide(slide),
+      _emit_interval(std::chrono::duration_cast<clock::duration>(
+          std::chrono::duration<double>(emit_interval))),
+      _top_k(top_k), _output(output),
+      _window(window.length / slide.length, n_shards),
+      _buffer(initial_buffer) {}
+
+void stream_master::run() {
+  _started = clock::now();
+  _next_emit = _started + _emit_interval;
+  _next_roll = _started + std::chrono::seconds(_slide.length);
+  size_t filled = 0;
+  while (true) {
+    pollfd p = {_fd, POLLIN, 0};
+    int ready = poll(&p, 1, poll_timeout(clock::now()));
+    if (ready < 0 && errno != EINTR) {
+      die("Cannot poll the input: %s\n", strerror(errno));
+    }
+    if (ready > 0) {
+      if (filled == _buffer.size()) {
+        // A line longer than the buffer.
+        _buffer.resize(_buffer.size() * 2);
+      }
+      ssize_t n = read(_fd, _buffer.data() + filled, _buffer.size() - filled);
+      if (n < 0 && errno != EINTR && errno != EAGAIN) {
+        die("Cannot read the input: %s\n", strerror(errno));
+      }
+      if (n == 0) {
+        break;
+      }
+      filled += std::max(n, (ssize_t)0);
+      // Only whole lines, the rest waits for its newline.
+      auto nl = (const char *)memrchr(_buffer.data(), '\n', filled);
+      if (nl) {
+        size_t used = nl + 1 - _buffer.data();
+        consume(_buffer.data(), nl + 1);
+        memmove(_buffer.data(), _buffer.data() + used, filled - used);
+        filled -= used;
+      }
+    }
+    tick(clock::now());
+  }
+  // The last line may not end with a newline.
+  consume(_buffer.data(), _buffer.data() + filled);
+  emit(clock::now());
+}
+
+void stream_master::consume(const char *begin, const char *end) {
+  std::hash<std::string_view> hasher;
+  for (mapped_line_iter line(begin, end); line.valid(); ++line) {
+    if (_slide.unit == window_length::lines &&
+        _window.pane_lines() == _slide.length) {
+      _window.roll();
+    }
+    _window.add(*line, hasher(*line));
+  }
+}
+
+void stream_master::tick(clock::time_point now) {
+  if (_slide.unit == window_length::seconds) {
+    auto slide = std::chrono::seconds(_slide.length);
+    // After a long pause every pane is old, more rolls change nothing.
+    for (size_t i = 0; now >= _next_roll; i++) {
+      if (i <= _window.n_panes()) {
+        _window.roll();
+      }
+      _next_roll += slide;
+    }
+  }
+  if (now >= _next_emit) {
+    emit(now);
+    _next_emit += _emit_interval;
+    if (_next_emit <= now) {
+      _next_emit = now + _emit_interval;
+    }
+  }
+}
+
+void stream_master::emit(clock::time_point now) {
+  sliding_window::top_type top(_top_k);
+  _window.top(top);
+  auto result = top.get_sorted();
+  std::chrono::duration<double> elapsed = now - _started;
+  fprintf(_output, "# %.3f %zu\n", elapsed.count(), _window.lines());
+  for (const auto &e : result) {
+    fprintf(_output, "%.*s %lu\n", (int)e.url.size(), e.url.data(), e.count);
+  }
+  fflush(_output);
+  _n_emits++;
+}
+
+int stream_master::poll_timeout(clock::time_point now) const {
+  auto until = _next_emit;
+  if (_slide.unit == window_length::seconds) {
+    until = std::min(until, _next_roll);
+  }
+  auto ms = std::chrono::ceil<std::chrono::milliseconds>(until - now);
+  return (int)std::max(ms.count(), (decltype(ms.count()))0);
+}
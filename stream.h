@@ -0,0 +1,62 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "window.h"
+
+/* The size of a window or of its slide, in lines or in seconds */
+struct window_length {
+  enum unit_type { lines, seconds };
+  unit_type unit = lines;
+  size_t length = 0;
+
+  /* "1000" is 1000 lines, "60s" is 60 seconds. Returns false if text is
+   * neither. */
+  static bool parse(const char *text, window_length &result);
+};
+
+/* Counts the urls of a stream, a pipe, a FIFO or a file that is still being
+ * written, over a sliding window, and prints the top k of the window every
+ * emit_interval seconds and at the end of the stream. Lines are counted as
+ * soon as they are read, so the top k printed is at most emit_interval
+ * seconds behind. */
+class stream_master {
+public:
+  using clock = std::chrono::steady_clock;
+
+  /* slide must have the unit of window and divide it, the window is then
+   * window / slide panes. A slide as long as the window tumbles. */
+  stream_master(int fd, window_length window, window_length slide,
+                double emit_interval, size_t top_k, size_t n_shards,
+                FILE *output = stdout);
+
+  /* Returns at the end of the stream */
+  void run();
+
+  /* How many times the top k was printed */
+  size_t n_emits() const { return _n_emits; }
+
+private:
+  static constexpr size_t initial_buffer = 1 << 20;
+
+  void consume(const char *begin, const char *end);
+  void tick(clock::time_point now);
+  void emit(clock::time_point now);
+  int poll_timeout(clock::time_point now) const;
+
+  int _fd;
+  window_length _slide;
+  clock::duration _emit_interval;
+  size_t _top_k;
+  FILE *_output;
+  sliding_window _window;
+  clock::time_point _started;
+  clock::time_point _next_emit;
+  clock::time_point _next_roll;
+  size_t _n_emits = 0;
+  std::vector<char> _buffer;
+};
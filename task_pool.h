@@ -0,0 +1,166 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <assert.h>
+#include <stddef.h>
+
+/* A fixed number of threads that run tasks. Every thread has a deque of its
+ * own: a task submitted from a pool thread goes to the back of its deque, the
+ * others are dealt round robin. A thread takes its newest task first and,
+ * once its deque is empty, steals the oldest task of another one. */
+class task_pool {
+public:
+  using task = std::function<void()>;
+
+  task_pool(size_t n_threads)
+      : _n_threads(std::max(n_threads, (size_t)1)),
+        _queues(std::make_unique<queue[]>(_n_threads)) {
+    for (size_t i = 0; i < _n_threads; i++) {
+      _threads.emplace_back([this, i] { worker(i); });
+    }
+  }
+
+  /* Runs the tasks that are left, then joins the threads. */
+  ~task_pool() {
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      _stopping = true;
+    }
+    _cv.notify_all();
+    for (auto &t : _threads) {
+      t.join();
+    }
+  }
+
+  void submit(task t) {
+    size_t i = current_pool == this ? current_index : _next++ % _n_threads;
+    {
+      std::lock_guard<std::mutex> lk(_queues[i].mtx);
+      _queues[i].tasks.push_back(std::move(t));
+    }
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      _queued++;
+    }
+    // Wakes a thread that waits for done() as well, it helps with the tasks.
+    _cv.notify_all();
+  }
+
+  /* Runs tasks on the calling thread until done() holds, so that a task can
+   * wait for the tasks it submitted without holding up a thread. */
+  template <typename Pred> void wait(Pred &&done) {
+    while (!done()) {
+      if (run_one()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(_mtx);
+      _cv.wait(lk, [&] { return _queued > 0 || done(); });
+    }
+  }
+
+  /* For tasks that change what a wait() is waiting for */
+  void notify() {
+    std::lock_guard<std::mutex> lk(_mtx);
+    _cv.notify_all();
+  }
+
+  size_t n_threads() const { return _n_threads; }
+
+private:
+  struct queue {
+    std::mutex mtx;
+    std::deque<task> tasks;
+  };
+
+  void worker(size_t index) {
+    current_pool = this;
+    current_index = index;
+    while (true) {
+      if (run_one()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(_mtx);
+      _cv.wait(lk, [this] { return _queued > 0 || _stopping; });
+      if (_queued == 0 && _stopping) {
+        break;
+      }
+    }
+  }
+
+  bool run_one() {
+    size_t self = current_pool == this ? current_index : 0;
+    task t;
+    for (size_t k = 0; k < _n_threads && !t; k++) {
+      auto &q = _queues[(self + k) % _n_threads];
+      std::lock_guard<std::mutex> lk(q.mtx);
+      if (q.tasks.empty()) {
+        continue;
+      }
+      if (k == 0 && current_pool == this) {
+        t = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        t = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+    }
+    if (!t) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      _queued--;
+    }
+    t();
+    return true;
+  }
+
+  static inline thread_local task_pool *current_pool = nullptr;
+  static inline thread_local size_t current_index = 0;
+
+  size_t _n_threads;
+  std::unique_ptr<queue[]> _queues;
+  std::atomic<size_t> _next{0};
+  std::mutex _mtx;
+  std::condition_variable _cv;
+  /* Tasks in the deques, not the ones running */
+  size_t _queued = 0;
+  bool _stopping = false;
+  std::vector<std::thread> _threads;
+};
+
+/* Tasks that are waited for together */
+class task_group {
+public:
+  task_group(task_pool &pool) : _pool(pool) {}
+
+  ~task_group() { wait(); }
+
+  template <typename F> void submit(F &&f) {
+    _pending++;
+    _pool.submit([pool = &_pool, pending = &_pending,
+                  f = std::forward<F>(f)]() mutable {
+      f();
+      // The group may be gone as soon as the count is down.
+      if (--*pending == 0) {
+        pool->notify();
+      }
+    });
+  }
+
+  void wait() {
+    _pool.wait([this] { return _pending == 0; });
+  }
+
+private:
+  task_pool &_pool;
+  std::atomic<size_t> _pending{0};
+};
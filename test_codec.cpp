@@ -0,0 +1,66 @@
+#include <catch2/catch.hpp>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+
+TEST_CASE("codec", "[codec spec]") {
+  std::vector<std::string> inputs = {"", "a", "abcd", "abcdabcdabcdabcd"};
+  // Literal and match lengths beyond a nibble, and beyond a byte of 255.
+  inputs.push_back(std::string(1000, 'x'));
+  std::string mixed;
+  srand(11);
+  for (int i = 0; i < 3000; i++) {
+    mixed += "http://www.site" + std::to_string(rand() % 50) + ".com/";
+    for (int j = rand() % 40; j > 0; j--) {
+      mixed.push_back('a' + rand() % 26);
+    }
+  }
+  inputs.push_back(mixed);
+  // Repeats further back than a 2 byte offset reaches.
+  inputs.push_back(mixed + mixed);
+
+  SECTION("should have none and lz in every build") {
+    REQUIRE(codec::find("none") == codec::none());
+    REQUIRE(codec::find("lz") != nullptr);
+    REQUIRE(codec::find(codec::find("lz")->id()) == codec::find("lz"));
+    REQUIRE(codec::find("nope") == nullptr);
+  }
+
+  SECTION("should give back what it was given") {
+    for (const char *name : {"none", "lz", "zstd", "lz4"}) {
+      const codec *c = codec::find(name);
+      if (!c) {
+        continue;
+      }
+      for (const auto &input : inputs) {
+        std::string compressed = "prefix";
+        c->compress(input.data(), input.size(), compressed);
+        REQUIRE(compressed.compare(0, 6, "prefix") == 0);
+        std::string output(input.size(), '\0');
+        REQUIRE(c->decompress(compressed.data() + 6, compressed.size() - 6,
+                              output.data(), output.size()));
+        REQUIRE(output == input);
+      }
+    }
+  }
+
+  SECTION("should shrink repeated bytes") {
+    std::string compressed;
+    codec::find("lz")->compress(inputs[4].data(), inputs[4].size(),
+                                compressed);
+    REQUIRE(compressed.size() < 20);
+  }
+
+  SECTION("should notice corrupted input") {
+    const codec *lz = codec::find("lz");
+    std::string compressed;
+    lz->compress(mixed.data(), mixed.size(), compressed);
+    std::string output(mixed.size(), '\0');
+    // Too short an output, and a cut input.
+    REQUIRE(!lz->decompress(compressed.data(), compressed.size(),
+                            output.data(), output.size() - 1));
+    REQUIRE(!lz->decompress(compressed.data(), compressed.size() / 2,
+                            output.data(), output.size()));
+  }
+}
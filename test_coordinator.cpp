@@ -0,0 +1,74 @@
+#include <catch2/catch.hpp>
+#include <map>
+#include <stdio.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "coordinator.h"
+
+TEST_CASE("coordinator", "[coordinator spec]") {
+  std::map<owned_url_t, count_t> result, expected, counts;
+  char inputs[2][32] = {"test-coordinator-XXXXXX", "test-coordinator-XXXXXX"};
+  srand(37);
+  for (auto &name : inputs) {
+    int fd = mkstemp(name);
+    REQUIRE(fd != -1);
+    FILE *output = fdopen(fd, "w");
+    for (int i = 0; i < 20000; i++) {
+      // hot/k comes up about k + 1 times as often as hot/0.
+      int k = 0;
+      for (int r = rand() % 21; r >= k + 1; r -= ++k) {
+      }
+      owned_url_t url = i % 4 == 0
+                            ? "http://hot/" + std::to_string(k)
+                            : "http://cold/" + std::to_string(rand() % 5000);
+      fprintf(output, "%s\n", url.c_str());
+      counts[url]++;
+    }
+    REQUIRE(fclose(output) == 0);
+  }
+  heap<entry<owned_url_t, false>> top(4);
+  for (const auto &e : counts) {
+    top.add(e.first, e.second);
+  }
+  for (const auto &e : top) {
+    expected.insert({e.url, e.count});
+  }
+
+  coordinator::options opts;
+  opts.inputs = {inputs[0], inputs[1]};
+  opts.spool = "test-coordinator-spool";
+  opts.n_shards = 3;
+  opts.mem_high_water_mark = 1 << 30;
+  opts.n_threads = 2;
+  opts.top_k = 4;
+
+  SECTION("should merge the runs of forked workers") {
+    coordinator c(opts);
+    c.fork_workers(3);
+    c.reduce();
+    for (auto it = c.result_begin(); it != c.result_end(); ++it) {
+      result.insert({it->url, it->count});
+    }
+  }
+
+  SECTION("should merge the runs of workers started apart") {
+    // As on other hosts: every worker on its own, the reduce at the end.
+    for (size_t i = 0; i < 2; i++) {
+      coordinator(opts).run_worker(i, 2);
+    }
+    coordinator c(opts);
+    c.reduce();
+    for (auto it = c.result_begin(); it != c.result_end(); ++it) {
+      result.insert({it->url, it->count});
+    }
+  }
+
+  REQUIRE(result == expected);
+  struct stat st;
+  REQUIRE(stat("test-coordinator-spool", &st) != 0);
+  for (auto &name : inputs) {
+    REQUIRE(unlink(name) == 0);
+  }
+}
@@ -0,0 +1,38 @@
+#include <catch2/catch.hpp>
+#include <map>
+#include <string>
+
+#include "count_min.h"
+
+TEST_CASE("count_min_sketch", "[count_min spec]") {
+  std::hash<slice_url_t> hasher;
+  // Far fewer cells than urls, so that the rows do collide.
+  count_min_sketch sketch(100);
+  std::map<owned_url_t, count_t> truth;
+  count_t total = 0;
+  for (int i = 0; i < 20000; i++) {
+    owned_url_t url = i % 4 == 0 ? "heavy" : "tail-" + std::to_string(i % 997);
+    sketch.add(hasher(url));
+    truth[url]++;
+    total++;
+  }
+
+  SECTION("should round the width up") { REQUIRE(sketch.width() == 128); }
+
+  SECTION("should never under-estimate") {
+    for (const auto &e : truth) {
+      REQUIRE(sketch.estimate(hasher(e.first)) >= e.second);
+    }
+  }
+
+  SECTION("should stay close for the heavy urls") {
+    count_t heavy = sketch.estimate(hasher("heavy"));
+    REQUIRE(heavy - truth["heavy"] <= total / sketch.width());
+  }
+
+  SECTION("should fit the budget") {
+    size_t width = count_min_sketch::width_for(1 << 20);
+    REQUIRE(count_min_sketch(width).mem_usage() <= (1 << 20));
+    REQUIRE(count_min_sketch(width).mem_usage() > (1 << 19));
+  }
+}
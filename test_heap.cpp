@@ -1,9 +1,12 @@
 #include <catch2/catch.hpp>
+#include <map>
 
 #define private public
 #include "heap.h"
 #undef private
 
+#include "entry.h"
+
 TEST_CASE("min_heap", "[minheap spec]") {
   struct entry {
     entry(uint64_t c) : count(c) {}
@@ -97,4 +100,42 @@ TEST_CASE("max_heap", "max_heap spec") {
       REQUIRE(h.poll() == (9 - i));
     }
   }
-}
\ No newline at end of file
+}
+TEST_CASE("heap of urls", "[minheap spec]") {
+  heap<entry<owned_url_t, false>> h(3);
+  std::vector<std::pair<std::string, count_t>> urls = {
+      {"a", 5}, {"b", 1}, {"c", 7}, {"d", 2}, {"e", 9}, {"f", 7}, {"g", 3}};
+  for (const auto &url : urls) {
+    // Views, the heap copies the ones it takes.
+    h.add(slice_url_t(url.first), url.second);
+  }
+  std::map<std::string, count_t> result;
+  for (const auto &e : h) {
+    result.emplace(e.url, e.count);
+  }
+  std::map<std::string, count_t> expected = {{"c", 7}, {"e", 9}, {"f", 7}};
+  REQUIRE(result == expected);
+  // A tie does not beat the front.
+  h.add(slice_url_t("h"), 7);
+  REQUIRE(h.front().url != "h");
+}
+
+TEST_CASE("key_aggregator", "[minheap spec]") {
+  std::vector<std::string> keys = {"x", "y", "y", "z", "z", "z"};
+  std::vector<entry<slice_url_t>> entries;
+  for (const auto &key : keys) {
+    // "y" and "z" collide.
+    entries.push_back({slice_url_t(key), 2, key == "x" ? (size_t)1 : 2});
+  }
+  std::vector<std::pair<std::string, count_t>> result;
+  key_aggregator aggregator([&](slice_url_t url, count_t count, size_t) {
+    result.emplace_back(url, count);
+  });
+  for (const auto &e : entries) {
+    aggregator.add(e);
+  }
+  aggregator.finish();
+  std::vector<std::pair<std::string, count_t>> expected = {
+      {"x", 2}, {"y", 4}, {"z", 6}};
+  REQUIRE(result == expected);
+}
@@ -1,7 +1,24 @@
 #include <catch2/catch.hpp>
 
+#include <map>
+#include <unistd.h>
+
 #include "iterator.h"
-#include "master.h"
+#include "sst.h"
+
+using table_t = std::map<owned_url_t, count_t>;
+
+/* SST runs are sorted by (hash, url) rather than by url like table_t. */
+static void write_table(const table_t &table, FILE *output,
+                        const codec *c = codec::none()) {
+  std::hash<slice_url_t> hasher;
+  std::vector<entry<slice_url_t>> entries;
+  for (const auto &e : table) {
+    entries.push_back({slice_url_t(e.first), e.second, hasher(e.first)});
+  }
+  std::sort(entries.begin(), entries.end(), key_less<entry<slice_url_t>>);
+  write_sst(entries, output, c);
+}
 
 template <typename Container> struct container_iterator : Container::iterator {
   Container &cont;
@@ -25,16 +42,17 @@ TEST_CASE("container_iterator", "[container_iterator spec]") {
   REQUIRE(v == copied);
 }
 
-TEST_CASE("merge_iterator", "[merge iterator spec]") {
+TEST_CASE("loser_tree_iter", "[loser tree iterator spec]") {
+  using vs_t = std::vector<entry<owned_url_t>>;
+  using iter_t = container_iterator<vs_t>;
+
   SECTION("should work with even iterators") {
-    using vs_t = std::vector<entry<owned_url_t>>;
-    using iter_t = container_iterator<vs_t>;
     vs_t v1 = {{"aba", 1}, {"bbb", 2}, {"cac", 3}};
     vs_t v2 = {{"aaa", 1}, {"bab", 2}, {"ccc", 3}};
     vs_t v3 = {{"aca", 1}, {"bcb", 2}, {"cbc", 3}};
 
     iter_t iters[3] = {{v1, v1.begin()}, {v2, v2.begin()}, {v3, v3.begin()}};
-    merge_iter<iter_t> miter(iters, iters + 3);
+    loser_tree_iter<iter_t> miter(iters, iters + 3);
 
     vs_t result,
         expected = {{"aaa", 1}, {"aba", 1}, {"aca", 1}, {"bab", 2}, {"bbb", 2},
@@ -46,6 +64,39 @@ TEST_CASE("merge_iterator", "[merge iterator spec]") {
     }
 
     REQUIRE(result == expected);
+    REQUIRE(!loser_tree_iter<iter_t>(iters, iters).valid());
+  }
+
+  SECTION("should agree with a sort on any fan-in") {
+    srand(42);
+    for (size_t k = 1; k <= 40; k++) {
+      std::vector<vs_t> runs(k);
+      for (auto &run : runs) {
+        size_t n = rand() % 20;
+        for (size_t i = 0; i < n; i++) {
+          run.push_back({std::to_string(rand() % 100), 1});
+        }
+        std::sort(run.begin(), run.end(), [](const auto &a, const auto &b) {
+          return a.url < b.url;
+        });
+      }
+      std::vector<iter_t> iters;
+      for (auto &run : runs) {
+        iters.push_back({run, run.begin()});
+      }
+      loser_tree_iter<iter_t> ltree(iters.begin(), iters.end());
+      std::vector<owned_url_t> result, expected;
+      for (; ltree.valid(); ++ltree) {
+        result.push_back(ltree->url);
+      }
+      for (const auto &run : runs) {
+        for (const auto &e : run) {
+          expected.push_back(e.url);
+        }
+      }
+      std::sort(expected.begin(), expected.end());
+      REQUIRE(result == expected);
+    }
   }
 }
 
@@ -62,19 +113,85 @@ TEST_CASE("read_line_iter", "[read_line_iter spec]") {
   REQUIRE(result == expected);
 }
 
-void write_sst(master::memtable_type memtable, FILE *output);
+TEST_CASE("mapped_line_iter", "[mapped_line_iter spec]") {
+  std::vector<std::string> expected = {"a", "b", "c", "d", "e", "f", "g"};
+
+  SECTION("should split the file like read_line_iter") {
+    mapped_file input("../read_line_iter_test.txt");
+    for (size_t n_ranges = 1; n_ranges <= input.size() + 1; n_ranges++) {
+      std::vector<size_t> bounds;
+      for (size_t i = 0; i <= n_ranges; i++) {
+        size_t offset =
+            i == n_ranges ? input.size() : input.size() / n_ranges * i;
+        bounds.push_back(input.align_to_line(offset));
+      }
+      std::vector<std::string> result;
+      for (size_t i = 0; i < n_ranges; i++) {
+        mapped_line_iter iter(input.data() + bounds[i],
+                              input.data() + bounds[i + 1]);
+        while (iter.valid()) {
+          result.emplace_back(*iter);
+          ++iter;
+        }
+      }
+      REQUIRE(result == expected);
+    }
+  }
+
+  SECTION("should not cap or split long lines") {
+    std::string text;
+    expected.clear();
+    // Every length around the block size, and lines far beyond fgets' 1024.
+    for (size_t len : {1, 63, 64, 65, 127, 128, 1023, 1024, 1025, 5000}) {
+      expected.push_back(std::string(len, 'a' + len % 26));
+      text += expected.back() + "\n\n";
+    }
+    expected.push_back("no newline at the end");
+    text += expected.back();
+    for (size_t skip = 0; skip < 3; skip++) {
+      // Unaligned starts as well
+      std::string shifted = std::string(skip, '\n') + text;
+      mapped_line_iter iter(shifted.data(), shifted.data() + shifted.size());
+      std::vector<std::string> result;
+      while (iter.valid()) {
+        result.emplace_back(*iter);
+        ++iter;
+      }
+      REQUIRE(result == expected);
+    }
+  }
+
+  SECTION("should map an empty file") {
+    FILE *empty = fopen("test-empty.txt", "w");
+    REQUIRE(empty != NULL);
+    REQUIRE(fclose(empty) == 0);
+    mapped_file input("test-empty.txt");
+    REQUIRE(input.size() == 0);
+    REQUIRE(!mapped_line_iter(input.data(), input.data()).valid());
+    REQUIRE(unlink("test-empty.txt") == 0);
+  }
+}
+
 TEST_CASE("sst", "[sst spec]") {
-  master::memtable_type result, expected = {
+  table_t result, expected = {
                                     {"abc", 1},
                                     {"def", 3},
                                     {"ghi", 2},
                                 };
   FILE *sst = fopen("test-sst.sst", "w+b");
   REQUIRE(sst != NULL);
-  write_sst(expected, sst);
+  write_table(expected, sst);
   REQUIRE(fclose(sst) == 0);
   sst = fopen("test-sst.sst", "rb");
   REQUIRE(sst != NULL);
+  // The version and the codec id are little endian on any host.
+  char header[sst::header_size];
+  REQUIRE(fread(header, 1, sizeof(header), sst) == sizeof(header));
+  REQUIRE(std::string(header, sizeof(header)) ==
+          std::string("TSST\x04\0\0\0\0\0\0\0", sst::header_size));
+  REQUIRE(sst::get_fixed64("\x01\x02\0\0\0\0\0\x80") ==
+          0x8000000000000201);
+  rewind(sst);
   sst_read_iter iter(sst);
   while (iter.valid()) {
     result.insert({std::string(iter->url), iter->count});
@@ -85,8 +202,196 @@ TEST_CASE("sst", "[sst spec]") {
   REQUIRE(unlink("test-sst.sst") == 0);
 }
 
+TEST_CASE("sst blocks", "[sst spec]") {
+  table_t result, expected;
+  for (int i = 0; i < 5000; i++) {
+    expected.insert({"http://www.example.com/" + std::to_string(i), i});
+  }
+  // Longer than any block, and shares nothing with its neighbours.
+  expected.insert({std::string(3 * sst::block_size, 'z'), 7});
+  FILE *sst = fopen("test-sst-blocks.sst", "w+b");
+  REQUIRE(sst != NULL);
+  write_table(expected, sst);
+  // Prefix compression and varints should beat the raw encoding.
+  REQUIRE((size_t)ftell(sst) < 5000 * (2 * sizeof(size_t) + 23));
+  REQUIRE(fclose(sst) == 0);
+  sst = fopen("test-sst-blocks.sst", "rb");
+  REQUIRE(sst != NULL);
+  sst_read_iter iter(sst);
+  while (iter.valid()) {
+    result.insert({std::string(iter->url), iter->count});
+    ++iter;
+  }
+  REQUIRE(result == expected);
+  REQUIRE(fclose(sst) == 0);
+  REQUIRE(unlink("test-sst-blocks.sst") == 0);
+}
+
+TEST_CASE("sst long urls", "[sst spec]") {
+  table_t result, expected;
+  // Far beyond any line buffer, and mostly shared between neighbours.
+  std::string prefix(10000, 'x');
+  for (int i = 0; i < 100; i++) {
+    expected.insert({prefix + std::to_string(i), i + 1});
+  }
+  FILE *sst = fopen("test-sst-long.sst", "w+b");
+  REQUIRE(sst != NULL);
+  write_table(expected, sst);
+  REQUIRE(fclose(sst) == 0);
+  sst = fopen("test-sst-long.sst", "rb");
+  REQUIRE(sst != NULL);
+  std::vector<std::string> urls;
+  for (sst_read_iter iter(sst); iter.valid(); ++iter) {
+    urls.emplace_back(iter->url);
+    result.insert({urls.back(), iter->count});
+  }
+  REQUIRE(result == expected);
+  sst_read_iter iter(sst);
+  for (int i = 0; i < 20; i++) {
+    ++iter;
+  }
+  // A copy carries on from the same entry, on its own.
+  sst_read_iter copy = iter;
+  ++iter;
+  for (size_t i = 20; i < urls.size(); i++) {
+    REQUIRE(copy.valid());
+    REQUIRE(copy->url == urls[i]);
+    ++copy;
+  }
+  REQUIRE(!copy.valid());
+  REQUIRE(iter->url == urls[21]);
+  REQUIRE(fclose(sst) == 0);
+  REQUIRE(unlink("test-sst-long.sst") == 0);
+}
+
+TEST_CASE("sst index", "[sst spec]") {
+  // 100 urls per hash, so that a hash spans the end of a block.
+  std::vector<std::string> urls;
+  for (int i = 0; i < 3000; i++) {
+    urls.push_back("http://www.example.com/" + std::to_string(i));
+  }
+  std::vector<entry<slice_url_t>> entries;
+  for (int i = 0; i < 3000; i++) {
+    entries.push_back({slice_url_t(urls[i]), 1, (size_t)i / 100 + 1});
+  }
+  std::sort(entries.begin(), entries.end(), key_less<entry<slice_url_t>>);
+  FILE *sst = fopen("test-sst-index.sst", "w+b");
+  REQUIRE(sst != NULL);
+  write_sst(entries, sst);
+  REQUIRE(fclose(sst) == 0);
+
+  sst = fopen("test-sst-index.sst", "rb");
+  REQUIRE(sst != NULL);
+  sst_read_iter iter(sst);
+  REQUIRE(iter.n_entries() == 3000);
+  REQUIRE(iter.min_hash() == 1);
+  REQUIRE(iter.max_hash() == 30);
+  auto hashes = iter.block_hashes();
+  REQUIRE(hashes.size() > 10);
+  REQUIRE(hashes.front() == 1);
+  REQUIRE(std::is_sorted(hashes.begin(), hashes.end()));
+  iter.close();
+
+  std::vector<std::pair<size_t, size_t>> ranges = {
+      {0, 0}, {1, 1}, {5, 7}, {hashes[3], hashes[3]}, {29, SIZE_MAX},
+      {31, SIZE_MAX}, {0, SIZE_MAX}};
+  // Every hash, wherever it starts between the restart points of a block.
+  for (size_t hash = 1; hash <= 31; hash++) {
+    ranges.push_back({hash, hash});
+  }
+  sst_read_iter whole(fopen("test-sst-index.sst", "rb"));
+  for (const auto &range : ranges) {
+    sst = fopen("test-sst-index.sst", "rb");
+    REQUIRE(sst != NULL);
+    std::vector<std::string> result, expected;
+    for (sst_read_iter iter(sst, range.first, range.second); iter.valid();
+         ++iter) {
+      result.emplace_back(iter->url);
+    }
+    for (const auto &e : entries) {
+      if (range.first <= e.hash && e.hash <= range.second) {
+        expected.emplace_back(e.url);
+      }
+    }
+    REQUIRE(result == expected);
+    REQUIRE(fclose(sst) == 0);
+    // The same through a view of a file that is opened once.
+    result.clear();
+    for (auto iter = whole.range(range.first, range.second); iter.valid();
+         ++iter) {
+      result.emplace_back(iter->url);
+    }
+    REQUIRE(result == expected);
+  }
+  whole.close();
+  REQUIRE(unlink("test-sst-index.sst") == 0);
+}
+
+TEST_CASE("sst codecs", "[sst spec]") {
+  table_t expected;
+  for (int i = 0; i < 5000; i++) {
+    expected.insert({"http://www.example.com/" + std::to_string(i), i});
+  }
+  // Random bytes do not compress, that block is stored raw.
+  std::string noise;
+  srand(7);
+  for (size_t i = 0; i < 2 * sst::block_size; i++) {
+    noise.push_back('a' + rand() % 26);
+  }
+  expected.insert({noise, 1});
+  std::map<std::string, long> sizes;
+  for (const char *name : {"none", "lz", "zstd", "lz4"}) {
+    const codec *c = codec::find(name);
+    if (!c) {
+      continue;
+    }
+    FILE *sst = fopen("test-sst-codec.sst", "w+b");
+    REQUIRE(sst != NULL);
+    write_table(expected, sst, c);
+    sizes[name] = ftell(sst);
+    REQUIRE(fclose(sst) == 0);
+
+    sst = fopen("test-sst-codec.sst", "rb");
+    REQUIRE(sst != NULL);
+    table_t result;
+    std::vector<std::string> urls;
+    std::vector<size_t> hashes;
+    for (sst_read_iter iter(sst); iter.valid(); ++iter) {
+      urls.emplace_back(iter->url);
+      hashes.push_back(iter->hash);
+      result.insert({urls.back(), iter->count});
+    }
+    REQUIRE(result == expected);
+    // A seek finds the restart points in a decompressed block as well.
+    for (size_t i : {1, 17, 2500, 4999}) {
+      sst_read_iter at(sst, hashes[i], hashes[i]);
+      REQUIRE(at.valid());
+      REQUIRE(at->url == urls[i]);
+    }
+    // A copy in a decompressed block carries on from its own copy of it.
+    sst_read_iter iter(sst);
+    for (int i = 0; i < 1000; i++) {
+      ++iter;
+    }
+    sst_read_iter copy = iter;
+    for (int i = 0; i < 1000; i++) {
+      ++iter;
+    }
+    for (size_t i = 1000; i < urls.size(); i++) {
+      REQUIRE(copy.valid());
+      REQUIRE(copy->url == urls[i]);
+      ++copy;
+    }
+    REQUIRE(!copy.valid());
+    REQUIRE(fclose(sst) == 0);
+  }
+  // Next to the hashes, prefix compression leaves little to find here.
+  REQUIRE(sizes["lz"] < sizes["none"]);
+  REQUIRE(unlink("test-sst-codec.sst") == 0);
+}
+
 TEST_CASE("merge sst", "[merge sst]") {
-  master::memtable_type result,
+  table_t result,
       memtables[3] = {{
                           {"abc", 1},
                           {"def", 3},
@@ -109,7 +414,7 @@ TEST_CASE("merge sst", "[merge sst]") {
     files[i] = "test_merge_sst-" + std::to_string(i) + ".sst";
     FILE *out = fopen(files[i].c_str(), "w+b");
     REQUIRE(out != NULL);
-    write_sst(memtables[i], out);
+    write_table(memtables[i], out);
     REQUIRE(fclose(out) == 0);
   }
   std::vector<sst_read_iter> iters;
@@ -119,7 +424,7 @@ TEST_CASE("merge sst", "[merge sst]") {
     iters.emplace_back(out);
   }
 
-  merge_iter<sst_read_iter> miter(iters.begin(), iters.end());
+  loser_tree_iter<sst_read_iter> miter(iters.begin(), iters.end());
   while (miter.valid()) {
     result.insert({owned_url_t(miter->url), miter->count});
     ++miter;
@@ -134,7 +439,7 @@ TEST_CASE("merge sst", "[merge sst]") {
 }
 
 TEST_CASE("merge sst eqaul", "[merge sst spec]") {
-  master::memtable_type result,
+  table_t result,
       memtables[3] = {{
                           {"abc", 1},
                           {"def", 3},
@@ -155,7 +460,7 @@ TEST_CASE("merge sst eqaul", "[merge sst spec]") {
     files[i] = "test_merge_sst-" + std::to_string(i) + ".sst";
     FILE *out = fopen(files[i].c_str(), "w+b");
     REQUIRE(out != NULL);
-    write_sst(memtables[i], out);
+    write_table(memtables[i], out);
     REQUIRE(fclose(out) == 0);
   }
   std::vector<sst_read_iter> iters;
@@ -165,7 +470,7 @@ TEST_CASE("merge sst eqaul", "[merge sst spec]") {
     iters.emplace_back(out);
   }
 
-  merge_iter<sst_read_iter> miter(iters.begin(), iters.end());
+  loser_tree_iter<sst_read_iter> miter(iters.begin(), iters.end());
   owned_url_t last = "";
   count_t last_count = 0;
   while (miter.valid()) {
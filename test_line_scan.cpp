@@ -0,0 +1,26 @@
+#include <catch2/catch.hpp>
+#include <stdlib.h>
+#include <string>
+
+#include "line_scan.h"
+
+TEST_CASE("line_scan", "[line_scan spec]") {
+  srand(5);
+  std::string text(64 * 100, 'x');
+  for (auto &c : text) {
+    c = rand() % 8 == 0 ? '\n' : 'a' + rand() % 26;
+  }
+  for (size_t offset = 0; offset + 64 <= text.size(); offset += 37) {
+    const char *p = text.data() + offset;
+    uint64_t expected = line_scan::newline_mask_scalar(p);
+    REQUIRE(line_scan::newline_mask(p) == expected);
+#if defined(__x86_64__) || defined(__i386__)
+    REQUIRE(line_scan::newline_mask_sse2(p) == expected);
+    if (__builtin_cpu_supports("avx2")) {
+      REQUIRE(line_scan::newline_mask_avx2(p) == expected);
+    }
+#endif
+  }
+  // The tail only looks at the bytes it is given.
+  REQUIRE(line_scan::newline_mask_scalar("\n\n\n", 2) == 3);
+}
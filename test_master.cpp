@@ -1,20 +1,156 @@
 #include <catch2/catch.hpp>
+#include <map>
+#include <memory>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "master.h"
 
+using counts_t = std::map<owned_url_t, count_t>;
+
+/* What the tests look at inside a master */
+struct master_access {
+  /* Accounts bytes instead of the RSS at construction for what the process
+   * holds besides the memtables, so that the watermark is all theirs */
+  static void assume_baseline(master &m, size_t bytes) {
+    m._mem_usage = m._mem_usage - m._baseline_usage + bytes;
+    m._baseline_usage = bytes;
+  }
+
+  /* Counts url from the calling thread, as its owner would */
+  static void count(master &m, std::string_view url) {
+    size_t hash = std::hash<std::string_view>()(url);
+    size_t owner = m.owner_of(hash % m._n_shards);
+    std::lock_guard<std::mutex> lk(m._owner_mtx[owner]);
+    m.shed_owner(owner);
+    m.on_new_url(url, hash);
+  }
+
+  static size_t memtable_usage(const master &m, size_t shard) {
+    return m._memtables[shard].mem_usage();
+  }
+  static size_t watermark(const master &m) { return m._watermark; }
+  static size_t shed_request(const master &m) { return m._shed_request; }
+  static size_t freeze_request(const master &m) { return m._freeze_request; }
+  /* Keeps owner busy as long as the lock is held */
+  static std::unique_lock<std::mutex> lock_owner(master &m, size_t owner) {
+    return std::unique_lock<std::mutex>(m._owner_mtx[owner]);
+  }
+  static void wait_for_flushes(master &m) { m.wait_for_flushes(); }
+  static std::string sst_filename(const master &m, size_t shard,
+                                  size_t epoch) {
+    return m.sst_filename(shard, epoch);
+  }
+
+  static size_t pinned(const master &m) {
+    size_t n = 0;
+    for (const auto &hh : m._heavy_hitters) {
+      n += hh.n_pinned;
+    }
+    return n;
+  }
+  static count_t threshold(const master &m) { return m._threshold; }
+  /* Runs written for the shard, and runs left for the merge */
+  static size_t epochs(const master &m, size_t shard) {
+    return m._epochs[shard];
+  }
+  static size_t runs(const master &m, size_t shard) {
+    return m._runs[shard].size();
+  }
+};
+
+/* An input file of urls and how often each one was written to it. It is
+ * removed at the end of the test. */
+class url_file {
+public:
+  url_file() {
+    int fd = mkstemp(_path);
+    REQUIRE(fd != -1);
+    _file = fdopen(fd, "w+");
+  }
+
+  ~url_file() {
+    fclose(_file);
+    unlink(_path);
+  }
+
+  void add(const owned_url_t &url) {
+    bytes += fprintf(_file, "%s\n", url.c_str());
+    counts[url]++;
+  }
+
+  /* Everything added so far, for a master to read */
+  const char *path() {
+    fflush(_file);
+    return _path;
+  }
+
+  counts_t top(size_t k) const {
+    heap<entry<owned_url_t, false>> top(k);
+    for (const auto &e : counts) {
+      top.add(e.first, e.second);
+    }
+    counts_t result;
+    for (const auto &e : top) {
+      result.insert({e.url, e.count});
+    }
+    return result;
+  }
+
+  counts_t counts;
+  size_t bytes = 0;
+
+private:
+  char _path[19] = "test-master-XXXXXX";
+  FILE *_file;
+};
+
+/* Url i of an input where every tenth url is hot: hot/k comes up k + 1 times
+ * in every 21 of the hot slots, so that the top counts have no ties. The
+ * others are drawn from n_cold cold urls. */
+static owned_url_t ranked_url(int i, int n_cold) {
+  if (i % 10 != 0) {
+    return "http://cold/" + std::to_string(rand() % n_cold);
+  }
+  int slot = i / 10 % 21, k = 0;
+  while ((k + 1) * (k + 2) / 2 <= slot) {
+    k++;
+  }
+  return "http://hot/" + std::to_string(k);
+}
+
+/* A master whose memtables get all of the watermark, whatever the test
+ * process holds. */
+static std::unique_ptr<master>
+make_master(const char *input, size_t n_shards, size_t watermark,
+            size_t top_k, size_t n_threads,
+            count_mode mode = count_mode::exact) {
+  auto m = std::make_unique<master>(input, n_shards, watermark, top_k,
+                                    n_threads, mode);
+  master_access::assume_baseline(*m, 0);
+  return m;
+}
+
+static counts_t run(master &m) {
+  m.start();
+  m.wait_for_all_workers();
+  counts_t result;
+  for (auto it = m.result_begin(); it != m.result_end(); ++it) {
+    result.insert({it->url, it->count});
+  }
+  return result;
+}
+
 TEST_CASE("master", "[master spec]") {
-  master::memtable_type result,
-      source =
-          {
-              {"abc", 4}, {"bec", 4}, {"def", 11}, {"ghi", 2}, {"mno", 6},
-          },
-      expected = {
-          {"abc", 4},
-          {"bec", 4},
-          {"def", 11},
-          {"mno", 6},
-      };
+  counts_t source = {
+      {"abc", 4}, {"bec", 4}, {"def", 11}, {"ghi", 2}, {"mno", 6},
+  };
+  counts_t expected = {
+      {"abc", 4},
+      {"bec", 4},
+      {"def", 11},
+      {"mno", 6},
+  };
 
   std::vector<owned_url_t> urls;
   for (const auto &e : source) {
@@ -25,20 +161,391 @@ TEST_CASE("master", "[master spec]") {
 
   std::random_shuffle(urls.begin(), urls.end());
 
-  char buf[] = "test-master-XXXXXX";
-  int fd = mkstemp(buf);
-  REQUIRE(fd != -1);
-  FILE *output = fdopen(fd, "w+");
+  url_file input;
   for (auto &url : urls) {
-    fprintf(output, "%s\n", url.c_str());
+    input.add(url);
   }
-  fflush(output);
-  master m(buf, 4, 72, 4);
-  m.start();
-  m.wait_for_all_workers();
-  REQUIRE(unlink(buf) == 0);
-  for (auto it = m.result_begin(); it != m.result_end(); ++it) {
-    result.insert({it->url, it->count});
+  SECTION("single threaded ingest") {
+    auto m = make_master(input.path(), 4, 72, 4, 1);
+    REQUIRE(run(*m) == expected);
+  }
+
+  SECTION("multi threaded ingest") {
+    auto m = make_master(input.path(), 4, 72, 4, 8);
+    REQUIRE(run(*m) == expected);
   }
+}
+
+TEST_CASE("master pins heavy hitters", "[master spec]") {
+  url_file input;
+  srand(7);
+  for (int i = 0; i < 200000; i++) {
+    // A few hot urls, and a long tail that forces plenty of flushes.
+    input.add(rand() % 2 ? "http://hot/" + std::to_string(rand() % 4)
+                         : "http://cold/" + std::to_string(rand()));
+  }
+  auto m = make_master(input.path(), 4, 1 << 20, 4, 2);
+  REQUIRE(run(*m) == input.top(4));
+  REQUIRE(master_access::pinned(*m) > 0);
+}
+
+TEST_CASE("master approximate", "[master spec]") {
+  url_file input;
+  srand(11);
+  for (int i = 0; i < 100000; i++) {
+    input.add(rand() % 2 ? "http://hot/" + std::to_string(rand() % 8)
+                         : "http://cold/" + std::to_string(rand()));
+  }
+  auto m =
+      make_master(input.path(), 4, 1 << 20, 8, 2, count_mode::approximate);
+  m->start();
+  m->wait_for_all_workers();
+  std::vector<master::heap_type::iterator::value_type> result(
+      m->result_begin(), m->result_end());
+  REQUIRE(result.size() == 8);
+  for (const auto &e : result) {
+    REQUIRE(e.count >= input.counts[e.url]);
+    REQUIRE(e.count - e.error <= input.counts[e.url]);
+    REQUIRE(e.url.rfind("http://hot/", 0) == 0);
+  }
+}
+
+TEST_CASE("master filtered", "[master spec]") {
+  url_file input;
+  srand(13);
+  for (int i = 0; i < 100000; i++) {
+    input.add(rand() % 2 ? "http://hot/" + std::to_string(rand() % 16)
+                         : "http://cold/" + std::to_string(rand()));
+  }
+  counts_t expected;
+  {
+    auto exact = make_master(input.path(), 4, 4 << 20, 8, 2);
+    expected = run(*exact);
+  }
+  auto m = make_master(input.path(), 4, 4 << 20, 8, 2, count_mode::filtered);
+  REQUIRE(run(*m) == expected);
+  for (auto it = m->result_begin(); it != m->result_end(); ++it) {
+    REQUIRE(it->error == 0);
+  }
+  // The long tail never made it into a memtable, so nothing was spilled.
+  REQUIRE(master_access::threshold(*m) > 1);
+  for (size_t shard = 0; shard < 4; shard++) {
+    REQUIRE(master_access::epochs(*m, shard) <= 1);
+  }
+}
+
+TEST_CASE("master compacts runs", "[master spec]") {
+  url_file input;
+  srand(17);
+  for (int i = 0; i < 300000; i++) {
+    input.add(rand() % 4 == 0
+                  ? "http://warm/" + std::to_string(rand() % 64)
+                  : "http://cold/" + std::to_string(rand() % 100000));
+  }
+  // Small memtables, so that every shard gets flushed many times.
+  auto m = make_master(input.path(), 2, 1 << 20, 4, 2);
+  REQUIRE(run(*m) == input.top(4));
+  // The final merge only saw what compaction left, the ids of the merged
+  // runs are gone.
+  for (size_t shard = 0; shard < 2; shard++) {
+    REQUIRE(master_access::runs(*m, shard) <
+            master_access::epochs(*m, shard));
+  }
+}
+
+TEST_CASE("master splits the merge of a shard", "[master spec]") {
+  url_file input;
+  srand(29);
+  for (int i = 0; i < 200000; i++) {
+    input.add(ranked_url(i, 100000));
+  }
+  // One shard and many threads, the runs are merged in key ranges.
+  auto m = make_master(input.path(), 1, 1 << 20, 4, 8);
+  REQUIRE(run(*m) == input.top(4));
+  REQUIRE(m->stats().merges[0].ranges > 1);
+  REQUIRE(m->stats().merges[0].distinct == input.counts.size());
+}
+
+TEST_CASE("master splits a hot shard", "[master spec]") {
+  url_file input;
+  std::hash<std::string_view> hasher;
+  srand(37);
+  // Nine in ten of the urls are in shard 0 of 4.
+  for (int i = 0; i < 200000; i++) {
+    owned_url_t url;
+    do {
+      url = ranked_url(i, 100000);
+    } while (i % 10 > 1 && hasher(url) % 4 != 0);
+    input.add(url);
+  }
+  // As many shards as threads, but shard 0 holds most of the bytes.
+  auto m = make_master(input.path(), 4, 1 << 20, 4, 4);
+  REQUIRE(run(*m) == input.top(4));
+  REQUIRE(m->stats().merges[0].ranges > 1);
+  REQUIRE(m->stats().merges[1].ranges == 1);
+}
+
+TEST_CASE("master stats", "[master spec]") {
+  url_file input;
+  srand(23);
+  for (int i = 0; i < 100000; i++) {
+    input.add("http://cold/" + std::to_string(rand() % 50000));
+  }
+  auto m = make_master(input.path(), 2, 1 << 20, 4, 2);
+  run(*m);
+  const auto &stats = m->stats();
+  REQUIRE(master_stats::sum(stats.readers, &ingest_counters::urls) == 100000);
+  REQUIRE(master_stats::sum(stats.readers, &ingest_counters::bytes) ==
+          input.bytes);
+  REQUIRE(master_stats::sum(stats.owners, &ingest_counters::urls) == 100000);
+  REQUIRE(stats.flushes > 0);
+  REQUIRE(stats.peak_mem_usage > 0);
+  REQUIRE(stats.phase_seconds[master_stats::ingest] > 0);
+  REQUIRE(stats.current_phase == master_stats::n_phases);
+  size_t distinct = 0, entries = 0;
+  for (size_t shard = 0; shard < 2; shard++) {
+    REQUIRE(stats.merges[shard].fan_in == master_access::runs(*m, shard));
+    distinct += stats.merges[shard].distinct;
+    entries += stats.merges[shard].entries;
+  }
+  // Every url is counted once by the merge, but may be in several runs.
+  REQUIRE(distinct == input.counts.size());
+  REQUIRE(entries >= distinct);
+}
+
+TEST_CASE("master spreads the runs over the spill dirs", "[master spec]") {
+  url_file input;
+  srand(31);
+  for (int i = 0; i < 100000; i++) {
+    input.add(ranked_url(i, 20000));
+  }
+  char first[] = "test-spill-XXXXXX", second[] = "test-spill-XXXXXX";
+  REQUIRE(mkdtemp(first) != NULL);
+  REQUIRE(mkdtemp(second) != NULL);
+  {
+    // More shards than "_%d" fitted in the old buffer.
+    auto m = make_master(input.path(), 100, 1 << 20, 4, 2);
+    m->spill_to({first, second});
+    REQUIRE(access((std::string(second) + "/_99").c_str(), F_OK) == 0);
+    REQUIRE(access("_99", F_OK) != 0);
+  }
+  {
+    auto m = make_master(input.path(), 4, 1 << 20, 4, 2);
+    m->spill_to({first, second});
+    // The epochs of a shard alternate, and so do the shards.
+    REQUIRE(master_access::sst_filename(*m, 0, 0) ==
+            std::string(first) + "/_0/stage-0.sst");
+    REQUIRE(master_access::sst_filename(*m, 0, 1) ==
+            std::string(second) + "/_0/stage-1.sst");
+    REQUIRE(master_access::sst_filename(*m, 1, 0) ==
+            std::string(second) + "/_1/stage-0.sst");
+    REQUIRE(run(*m) == input.top(4));
+    REQUIRE(m->stats().flushes > 1);
+  }
+  // Nothing is left in them.
+  REQUIRE(rmdir(first) == 0);
+  REQUIRE(rmdir(second) == 0);
+}
+
+TEST_CASE("master checkpoints", "[master spec]") {
+  url_file input;
+  counts_t tail;
+  srand(29);
+  size_t half = 0;
+  for (int i = 0; i < 100000; i++) {
+    owned_url_t url = ranked_url(i, 20000);
+    input.add(url);
+    if (i == 50000 - 1) {
+      half = input.bytes;
+    }
+    if (i >= 50000) {
+      tail[url]++;
+    }
+  }
+  const char *path = input.path();
+  struct stat st;
+  REQUIRE(stat(path, &st) == 0);
+  auto write_manifest = [&](size_t begin, size_t end) {
+    FILE *manifest = fopen("checkpoint.manifest", "w");
+    REQUIRE(manifest != NULL);
+    fprintf(manifest,
+            "top100-checkpoint 2\ninput %zu %ld %ld\nshards 2\n"
+            "spill dirs 1\n",
+            (size_t)st.st_size, (long)st.st_mtim.tv_sec,
+            (long)st.st_mtim.tv_nsec);
+    fprintf(manifest, "ranges 1\n%zu %zu\nshard 0 0 0\nshard 1 0 0\n", begin,
+            end);
+    REQUIRE(fclose(manifest) == 0);
+  };
+  counts_t result, expected;
+
+  SECTION("should count everything while writing checkpoints") {
+    expected = input.top(4);
+    auto m = make_master(path, 2, 1 << 20, 4, 4);
+    m->checkpoint_every(256 * 1024);
+    result = run(*m);
+    REQUIRE(m->stats().checkpoints > 1);
+  }
+
+  SECTION("should go on from the offsets in the manifest") {
+    // Nothing was counted before the checkpoint in the middle.
+    url_file counted;
+    counted.counts = tail;
+    expected = counted.top(4);
+    write_manifest(half, st.st_size);
+    auto m = make_master(path, 2, 1 << 20, 4, 4);
+    result = run(*m);
+    REQUIRE(master_stats::sum(m->stats().readers, &ingest_counters::urls) ==
+            50000);
+  }
+
+  SECTION("should not merge a shard twice") {
+    // The input is all read, and shard 0 was merged before the crash.
+    write_manifest(st.st_size, st.st_size);
+    auto m = make_master(path, 2, 1 << 20, 4, 4);
+    FILE *merged = fopen("_0/result.txt", "w");
+    REQUIRE(merged != NULL);
+    fprintf(merged, "7 http://merged/a\n5 http://merged/b\n");
+    REQUIRE(fclose(merged) == 0);
+    expected = {{"http://merged/a", 7}, {"http://merged/b", 5}};
+    result = run(*m);
+    REQUIRE(m->stats().merges[0].fan_in == 0);
+  }
+
   REQUIRE(result == expected);
-}
\ No newline at end of file
+  REQUIRE(access("checkpoint.manifest", F_OK) != 0);
+  REQUIRE(access("_0/result.txt", F_OK) != 0);
+}
+
+TEST_CASE("master sheds the largest memtables", "[master spec]") {
+  char spill[] = "test-spill-XXXXXX";
+  REQUIRE(mkdtemp(spill) != NULL);
+  {
+    auto m = make_master("unused", 4, 1024 * 1024 * 1024, 4, 2);
+    m->spill_to({spill});
+    // Shard 1 gets ten times the urls of the others.
+    std::hash<slice_url_t> hasher;
+    for (int i = 0; i < 4000; i++) {
+      owned_url_t url = "http://shed/" + std::to_string(i);
+      if (hasher(url) % 4 == 1 || i % 10 == 0) {
+        master_access::count(*m, url);
+      }
+    }
+    size_t largest = master_access::memtable_usage(*m, 1);
+    m->shed(1);
+    REQUIRE(m->stats().shed_bytes == largest);
+    REQUIRE(master_access::shed_request(*m) == 0);
+    REQUIRE(master_access::memtable_usage(*m, 1) == 0);
+    REQUIRE(master_access::memtable_usage(*m, 0) > 0);
+    master_access::wait_for_flushes(*m);
+    REQUIRE(master_access::runs(*m, 1) == 1);
+
+    // Everything goes, and a request this big is not left over for the
+    // urls counted later.
+    m->shed(SIZE_MAX);
+    master_access::wait_for_flushes(*m);
+    size_t flushes = m->stats().flushes;
+    REQUIRE(flushes == 4);
+    for (int i = 0; i < 1000; i++) {
+      master_access::count(*m, "http://later/" + std::to_string(i));
+    }
+    master_access::wait_for_flushes(*m);
+    REQUIRE(m->stats().flushes == flushes);
+    for (size_t shard = 0; shard < 4; shard++) {
+      REQUIRE(master_access::memtable_usage(*m, shard) > 0);
+    }
+
+    // The memtables keep some room whatever the controller says.
+    m->limit_memory(0);
+    REQUIRE(master_access::watermark(*m) > 0);
+    m->limit_memory(512 * 1024 * 1024);
+    REQUIRE(master_access::watermark(*m) == 512 * 1024 * 1024);
+  }
+  REQUIRE(system(("rm -r " + std::string(spill)).c_str()) == 0);
+}
+
+TEST_CASE("master sheds no more than the memtables hold", "[master spec]") {
+  char spill[] = "test-spill-XXXXXX";
+  REQUIRE(mkdtemp(spill) != NULL);
+  {
+    auto m = make_master("unused", 4, 1024 * 1024 * 1024, 4, 2);
+    m->spill_to({spill});
+    // Enough samples of one url to pin it.
+    for (int i = 0; i < 70000; i++) {
+      master_access::count(*m, "http://pinned/");
+    }
+    REQUIRE(master_access::pinned(*m) == 1);
+    m->shed(SIZE_MAX);
+    master_access::wait_for_flushes(*m);
+    REQUIRE(master_access::shed_request(*m) == 0);
+    size_t flushes = m->stats().flushes;
+
+    // The pinned table holds more than this, but cannot be frozen, so
+    // nothing is left for the owners to do.
+    m->shed(1);
+    REQUIRE(master_access::shed_request(*m) == 0);
+    for (int i = 0; i < 1000; i++) {
+      master_access::count(*m, "http://later/" + std::to_string(i));
+    }
+    master_access::wait_for_flushes(*m);
+    REQUIRE(m->stats().flushes == flushes);
+  }
+  REQUIRE(system(("rm -r " + std::string(spill)).c_str()) == 0);
+}
+
+TEST_CASE("master freezes the largest memtable of any owner",
+          "[master spec]") {
+  char spill[] = "test-spill-XXXXXX";
+  REQUIRE(mkdtemp(spill) != NULL);
+  {
+    // Two owners: shards 0 and 2 belong to the first, 1 and 3 to the other.
+    auto m = make_master("unused", 4, 1 << 20, 4, 4);
+    m->spill_to({spill});
+    std::hash<slice_url_t> hasher;
+    owned_url_t first, second;
+    for (int i = 0; i < 20000; i++) {
+      owned_url_t url = "http://owners/" + std::to_string(i);
+      size_t shard = hasher(url) % 4;
+      if (shard == 1 || (shard == 0 && i % 100 == 0)) {
+        master_access::count(*m, url);
+      } else if (shard == 0) {
+        first = url;
+      } else if (shard == 3 && second.empty()) {
+        second = url;
+        master_access::count(*m, second);
+      }
+    }
+    size_t held = master_access::memtable_usage(*m, 0) +
+                  master_access::memtable_usage(*m, 1);
+    REQUIRE(held > master_access::watermark(*m) / 8);
+    REQUIRE(m->stats().flushes == 0);
+    // A new url of the first owner crosses the watermark, the memtable of
+    // the other owner is the one to go.
+    m->limit_memory(held);
+
+    SECTION("should freeze it right away when its owner is idle") {
+      master_access::count(*m, first);
+    }
+
+    SECTION("should hand it over when its owner is busy") {
+      {
+        auto busy = master_access::lock_owner(*m, 1);
+        master_access::count(*m, first);
+        REQUIRE(master_access::freeze_request(*m) > 0);
+        // The controller withdrawing its own request leaves it alone.
+        m->shed(0);
+      }
+      master_access::wait_for_flushes(*m);
+      REQUIRE(m->stats().flushes == 0);
+      // Counted before, so only the request can freeze anything.
+      master_access::count(*m, second);
+      REQUIRE(master_access::freeze_request(*m) == 0);
+    }
+
+    master_access::wait_for_flushes(*m);
+    REQUIRE(m->stats().flushes == 1);
+    REQUIRE(master_access::memtable_usage(*m, 1) == 0);
+    REQUIRE(master_access::memtable_usage(*m, 0) > 0);
+  }
+  REQUIRE(system(("rm -r " + std::string(spill)).c_str()) == 0);
+}
@@ -0,0 +1,153 @@
+#include <catch2/catch.hpp>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory_controller.h"
+
+constexpr size_t MB = 1024 * 1024;
+
+static void write_file(const std::string &path, const std::string &text) {
+  FILE *out = fopen(path.c_str(), "w");
+  REQUIRE(out != NULL);
+  fputs(text.c_str(), out);
+  REQUIRE(fclose(out) == 0);
+}
+
+TEST_CASE("memory_controller", "[memory_controller spec]") {
+  memory_controller::options opts;
+  opts.limit = 1024 * MB;
+  opts.watermark = 900 * MB;
+  memory_controller controller(opts);
+
+  SECTION("should leave the watermark alone when there is room") {
+    memory_controller::sample s;
+    s.rss = 100 * MB;
+    auto d = controller.decide(s);
+    REQUIRE(d.budget == 1024 * MB);
+    REQUIRE(d.watermark == 900 * MB);
+    REQUIRE(d.shed == 0);
+    REQUIRE(!d.release_reserve);
+  }
+
+  SECTION("should shrink to what the cgroup leaves") {
+    memory_controller::sample s;
+    s.rss = 100 * MB;
+    s.cgroup_max = 612 * MB;
+    // Another process of the cgroup, or the page cache, holds 100M.
+    s.cgroup_current = 200 * MB;
+    auto d = controller.decide(s);
+    REQUIRE(d.budget == 512 * MB);
+    REQUIRE(d.watermark == 450 * MB);
+    REQUIRE(d.shed == 0);
+  }
+
+  SECTION("should back off under pressure") {
+    memory_controller::sample s;
+    s.rss = 100 * MB;
+    s.pressure = 5;
+    REQUIRE(controller.decide(s).watermark == 900 * MB);
+    s.pressure = 20;
+    REQUIRE(controller.decide(s).watermark == Approx(720 * MB));
+    s.pressure = 90;
+    REQUIRE(controller.decide(s).watermark == Approx(450 * MB));
+  }
+
+  SECTION("should shed what is beyond the target") {
+    memory_controller::sample s;
+    // The target is 1024M less a sixteenth, 960M.
+    s.rss = 980 * MB;
+    auto d = controller.decide(s);
+    REQUIRE(d.shed == 20 * MB);
+    REQUIRE(d.watermark == 880 * MB);
+    REQUIRE(!d.release_reserve);
+    s.rss = 1010 * MB;
+    REQUIRE(controller.decide(s).release_reserve);
+  }
+
+  SECTION("should read the kernel files") {
+    char dir[] = "test-memory-XXXXXX";
+    REQUIRE(mkdtemp(dir) != NULL);
+    std::string root = dir;
+    write_file(root + "/statm", "5000 3000 1000 10 0 2500 0\n");
+    write_file(root + "/pressure",
+               "some avg10=1.50 avg60=0.00 avg300=0.00 total=0\n"
+               "full avg10=0.50 avg60=0.00 avg300=0.00 total=0\n");
+    auto s = memory_controller::read_sample(root + "/statm", "",
+                                            root + "/pressure");
+    REQUIRE(s.rss == 2000 * (size_t)getpagesize());
+    REQUIRE(s.cgroup_max == SIZE_MAX);
+    REQUIRE(s.pressure == Approx(1.5));
+
+    // A cgroup v2 of its own, which has the last word on the pressure.
+    write_file(root + "/cgroup", "0::/job\n");
+    REQUIRE(memory_controller::find_cgroup(root + "/cgroup", root).empty());
+    REQUIRE(mkdir((root + "/job").c_str(), 0700) == 0);
+    write_file(root + "/job/memory.max", "max\n");
+    write_file(root + "/job/memory.current", "16384\n");
+    write_file(root + "/job/memory.stat",
+               "anon 4096\nfile 12288\nactive_file 4096\n"
+               "inactive_file 8192\n");
+    write_file(root + "/job/memory.pressure",
+               "some avg10=12.00 avg60=0.00 avg300=0.00 total=0\n");
+    std::string cgroup = memory_controller::find_cgroup(root + "/cgroup", root);
+    REQUIRE(cgroup == root + "/job");
+    s = memory_controller::read_sample(root + "/statm", cgroup,
+                                       root + "/pressure");
+    REQUIRE(s.cgroup_max == SIZE_MAX);
+    // The inactive file cache does not count.
+    REQUIRE(s.cgroup_current == 8192);
+    REQUIRE(s.pressure == Approx(12));
+    write_file(root + "/job/memory.max", "1073741824\n");
+    s = memory_controller::read_sample(root + "/statm", cgroup,
+                                       root + "/pressure");
+    REQUIRE(s.cgroup_max == 1024 * MB);
+
+    // cgroup v1 only.
+    write_file(root + "/cgroup", "4:memory:/job\n");
+    REQUIRE(memory_controller::find_cgroup(root + "/cgroup", root).empty());
+    REQUIRE(system(("rm -r " + root).c_str()) == 0);
+  }
+
+  SECTION("should move the watermark and shed from its thread") {
+    char statm[] = "test-statm-XXXXXX";
+    int fd = mkstemp(statm);
+    REQUIRE(fd != -1);
+    REQUIRE(close(fd) == 0);
+    // 2000 anonymous pages, beyond the limit.
+    write_file(statm, "5000 3000 1000 10 0 2500 0\n");
+    size_t watermark = 0;
+    memory_controller::options tight = opts;
+    tight.limit = 1 * MB;
+    tight.watermark = 1 * MB;
+    tight.reserve = 0;
+    tight.interval = 0.001;
+    tight.statm = statm;
+    memory_controller c(tight);
+    size_t shed = 0;
+    c.start([&](size_t w) { watermark = w; },
+            [&](size_t bytes) { shed += bytes; });
+    c.stop();
+    REQUIRE(watermark == 0);
+    REQUIRE(shed > 0);
+    REQUIRE(shed < SIZE_MAX);
+
+    // With room, every tick withdraws what the last one asked for.
+    tight.limit = 1024 * MB;
+    memory_controller roomy(tight);
+    size_t calls = 0;
+    shed = 0;
+    roomy.start([&](size_t) {},
+                [&](size_t bytes) {
+                  calls++;
+                  shed += bytes;
+                });
+    roomy.stop();
+    REQUIRE(calls > 0);
+    REQUIRE(shed == 0);
+    REQUIRE(unlink(statm) == 0);
+  }
+}
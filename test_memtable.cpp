@@ -0,0 +1,155 @@
+#include <catch2/catch.hpp>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "memtable.h"
+
+TEST_CASE("memtable", "[memtable spec]") {
+  std::hash<slice_url_t> hasher;
+  memtable table;
+  std::map<owned_url_t, count_t> expected;
+  for (int i = 0; i < 10000; i++) {
+    owned_url_t url = "http://www.example.com/" + std::to_string(i % 3001);
+    if (!table.increment(url, hasher(url))) {
+      table.insert(url, hasher(url));
+    }
+    expected[url]++;
+  }
+
+  SECTION("should count every key") {
+    REQUIRE(table.size() == expected.size());
+    REQUIRE(table.mem_usage() > 0);
+  }
+
+  SECTION("should survive colliding hashes") {
+    memtable collide;
+    for (int i = 0; i < 1000; i++) {
+      owned_url_t url = std::to_string(i % 10);
+      if (!collide.increment(url, 0)) {
+        collide.insert(url, 0);
+      }
+    }
+    REQUIRE(collide.size() == 10);
+    auto sorted = collide.sorted();
+    for (const auto &e : sorted) {
+      REQUIRE(e.count == 100);
+    }
+    // Equal hashes fall back to the urls.
+    REQUIRE(std::is_sorted(sorted.begin(), sorted.end(),
+                           [](const auto &lhs, const auto &rhs) {
+                             return lhs.url < rhs.url;
+                           }));
+  }
+
+  SECTION("should be sorted by hash and url") {
+    std::map<owned_url_t, count_t> result;
+    auto sorted = table.sorted();
+    for (const auto &e : sorted) {
+      REQUIRE(e.hash == hasher(e.url));
+      result.emplace(e.url, e.count);
+    }
+    REQUIRE(std::is_sorted(sorted.begin(), sorted.end(),
+                           key_less<memtable::entry_type>));
+    REQUIRE(result == expected);
+  }
+
+  SECTION("should measure what malloc handed out") {
+    size_t before = table.mem_usage();
+    REQUIRE(before >= table.size() * sizeof(memtable::entry_type));
+    memtable moved(std::move(table));
+    REQUIRE(moved.mem_usage() == before);
+    REQUIRE(table.mem_usage() == 0);
+    // The old table is fresh, and counts on its own.
+    table.insert("http://www.example.com/", hasher("x"));
+    REQUIRE(table.mem_usage() > 0);
+    REQUIRE(moved.mem_usage() == before);
+    moved.clear();
+    REQUIRE(moved.mem_usage() == 0);
+  }
+
+  SECTION("should bound what an insert allocates") {
+    memtable grown;
+    for (int i = 0; i < 20000; i++) {
+      owned_url_t url = "http://" + std::to_string(i % 700) + ".example.com/" +
+                        std::to_string(i);
+      size_t growth = grown.growth(url);
+      size_t before = grown.mem_usage();
+      grown.insert(url, hasher(url));
+      REQUIRE(grown.mem_usage() - before <= growth);
+    }
+    REQUIRE(grown.n_hosts() == 700);
+  }
+
+  SECTION("should intern the hosts") {
+    memtable hosts;
+    std::vector<owned_url_t> urls = {"http://a.com/x", "http://a.com/y",
+                                     "https://a.com/x", "http://b.com",
+                                     "no-scheme/x"};
+    for (const auto &url : urls) {
+      hosts.insert(url, hasher(url));
+    }
+    REQUIRE(hosts.n_hosts() == 3);
+    for (const auto &url : urls) {
+      REQUIRE(hosts.count_of(url, hasher(url)) == 1);
+    }
+    // A prefix of a key, or a host of its own, is not the key.
+    REQUIRE(!hosts.contains("http://a.com/", hasher("http://a.com/x")));
+    REQUIRE(!hosts.contains("http://b.co", hasher("http://b.com")));
+    std::vector<owned_url_t> seen;
+    hosts.for_each(
+        [&](const memtable::entry_type &e) { seen.emplace_back(e.url); });
+    for (const auto &e : hosts.sorted()) {
+      REQUIRE(e.hash == hasher(e.url));
+      REQUIRE(std::count(seen.begin(), seen.end(), owned_url_t(e.url)) == 1);
+    }
+    REQUIRE(seen.size() == urls.size());
+  }
+
+  SECTION("should only take a host after a scheme") {
+    memtable hosts;
+    std::vector<owned_url_t> urls = {"/r?u=http://x.com/y", "a b://c.com/d",
+                                     "1http://e.com/f", "://g.com/h",
+                                     "svn+ssh://i.com/j"};
+    for (const auto &url : urls) {
+      hosts.insert(url, hasher(url));
+    }
+    REQUIRE(hosts.n_hosts() == 1);
+    for (const auto &url : urls) {
+      REQUIRE(hosts.count_of(url, hasher(url)) == 1);
+    }
+  }
+
+  SECTION("should keep the urls past max_hosts whole") {
+    memtable hosts;
+    auto url_of = [](size_t i) {
+      return "http://" + std::to_string(i) + ".com/x";
+    };
+    size_t n = memtable::max_hosts + 10;
+    for (size_t i = 0; i < n; i++) {
+      owned_url_t url = url_of(i);
+      hosts.insert(url, hasher(url), i + 1);
+    }
+    REQUIRE(hosts.n_hosts() == memtable::max_hosts);
+    for (size_t i = 0; i < n; i += 997) {
+      owned_url_t url = url_of(i);
+      REQUIRE(hosts.increment(url, hasher(url)));
+      REQUIRE(hosts.count_of(url, hasher(url)) == i + 2);
+    }
+    owned_url_t last = url_of(n - 1);
+    REQUIRE(hosts.count_of(last, hasher(last)) == n);
+    size_t seen = 0;
+    for (const auto &e : hosts.sorted()) {
+      REQUIRE(e.hash == hasher(e.url));
+      seen++;
+    }
+    REQUIRE(seen == n);
+  }
+
+  SECTION("should release everything on clear") {
+    table.clear();
+    REQUIRE(table.empty());
+    REQUIRE(table.mem_usage() == 0);
+    REQUIRE(!table.increment("http://www.example.com/1", hasher("x")));
+  }
+}
@@ -1,10 +1,42 @@
 #include <catch2/catch.hpp>
+#include <map>
 #include <stdint.h>
 
 #include "memusage_allocator.h"
+#include "types.h"
 
-size_t get_entry_overhead();
+size_t get_entry_overhead() {
+  std::map<owned_url_t, count_t, std::less<>,
+           memusage_allocator<std::pair<owned_url_t, count_t>>>
+      m;
+  memusage_measure_guard g;
+  m.insert({"", 1});
+  return g.current_usage();
+}
 
 TEST_CASE("memusage_allocator", "[spec]") {
   SECTION("should report correct size") { REQUIRE(get_entry_overhead() > 0); }
-}
\ No newline at end of file
+}
+
+TEST_CASE("memusage_allocator counter", "[spec]") {
+  memusage_counter counter;
+  memusage_allocator<char> alloc(&counter);
+  char *small = alloc.allocate(1);
+  // A malloc chunk is never smaller than a few words.
+  REQUIRE(counter.bytes >= 2 * sizeof(size_t));
+  size_t before = counter.bytes;
+  char *large = alloc.allocate(1 << 20);
+  REQUIRE(counter.bytes - before >= (1 << 20));
+  // What a request may take bounds what the counter records for it.
+  REQUIRE(counter.bytes - before <=
+          memusage_allocator<char>::footprint((size_t)(1 << 20)));
+  // Rebound copies count into the same counter.
+  memusage_allocator<size_t> rebound(alloc);
+  REQUIRE(rebound == alloc);
+  size_t *words = rebound.allocate(100);
+  REQUIRE(counter.bytes - before >= (1 << 20) + 100 * sizeof(size_t));
+  rebound.deallocate(words, 100);
+  alloc.deallocate(large, 1 << 20);
+  alloc.deallocate(small, 1);
+  REQUIRE(counter.bytes == 0);
+}
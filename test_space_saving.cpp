@@ -0,0 +1,40 @@
+#include <catch2/catch.hpp>
+#include <map>
+#include <string>
+
+#include "space_saving.h"
+
+TEST_CASE("space_saving", "[space_saving spec]") {
+  std::hash<slice_url_t> hasher;
+  space_saving ss(8);
+  std::map<owned_url_t, count_t> truth;
+  // Two heavy urls among a long tail that keeps evicting the counters.
+  for (int i = 0; i < 10000; i++) {
+    owned_url_t url = i % 3 == 0   ? "heavy-a"
+                      : i % 3 == 1 ? "heavy-b"
+                                   : "tail-" + std::to_string(i);
+    ss.add(url, hasher(url));
+    truth[url]++;
+  }
+
+  SECTION("should track the total") { REQUIRE(ss.total() == 10000); }
+
+  SECTION("should bound the error of every counter") {
+    REQUIRE(ss.counters().size() == 8);
+    for (const auto &c : ss.counters()) {
+      REQUIRE(c.count >= truth[c.url]);
+      REQUIRE(c.count - c.error <= truth[c.url]);
+      REQUIRE(c.error <= ss.total() / 8);
+    }
+  }
+
+  SECTION("should keep the heavy hitters") {
+    for (auto url : {"heavy-a", "heavy-b"}) {
+      auto c = ss.find(url, hasher(url));
+      REQUIRE(c != nullptr);
+      REQUIRE(c->count - c->error <= truth[url]);
+      REQUIRE(c->count >= truth[url]);
+    }
+    REQUIRE(ss.find("tail-2", hasher("tail-2")) == nullptr);
+  }
+}
@@ -0,0 +1,49 @@
+#include <catch2/catch.hpp>
+#include <thread>
+
+#include "spsc_queue.h"
+
+TEST_CASE("spsc_queue", "[spsc_queue spec]") {
+  SECTION("should respect the capacity") {
+    spsc_queue<int> q(2);
+    int v;
+    REQUIRE(!q.try_pop(v));
+    REQUIRE(q.try_push(1));
+    REQUIRE(q.try_push(2));
+    REQUIRE(!q.try_push(3));
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == 1);
+    REQUIRE(q.try_push(3));
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == 2);
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == 3);
+    REQUIRE(!q.try_pop(v));
+  }
+
+  SECTION("should keep the order across threads") {
+    constexpr int n = 100000;
+    spsc_queue<int> q(16);
+    std::thread producer([&q] {
+      for (int i = 0; i < n; i++) {
+        int v = i;
+        while (!q.try_push(std::move(v))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    std::vector<int> result;
+    int v;
+    while (result.size() < n) {
+      if (q.try_pop(v)) {
+        result.push_back(v);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    producer.join();
+    for (int i = 0; i < n; i++) {
+      REQUIRE(result[i] == i);
+    }
+  }
+}
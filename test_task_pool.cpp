@@ -0,0 +1,75 @@
+#include <catch2/catch.hpp>
+#include <atomic>
+#include <set>
+#include <thread>
+
+#include "task_pool.h"
+
+TEST_CASE("task_pool", "[task_pool spec]") {
+  SECTION("should run every task once") {
+    task_pool pool(4);
+    std::atomic<size_t> sum{0};
+    {
+      task_group group(pool);
+      for (size_t i = 1; i <= 1000; i++) {
+        group.submit([&sum, i] { sum += i; });
+      }
+      group.wait();
+      REQUIRE(sum == 500500);
+    }
+  }
+
+  SECTION("should not deadlock when a task waits for its own tasks") {
+    // One thread: the waiting task has to run its children itself.
+    task_pool pool(1);
+    std::atomic<size_t> leaves{0};
+    task_group outer(pool);
+    for (int i = 0; i < 8; i++) {
+      outer.submit([&pool, &leaves] {
+        task_group inner(pool);
+        for (int j = 0; j < 8; j++) {
+          inner.submit([&leaves] { leaves++; });
+        }
+        inner.wait();
+      });
+    }
+    outer.wait();
+    REQUIRE(leaves == 64);
+  }
+
+  SECTION("should let idle threads steal") {
+    task_pool pool(4);
+    std::mutex mtx;
+    std::set<std::thread::id> threads;
+    std::atomic<size_t> started{0};
+    task_group group(pool);
+    // All the tasks go to the deque of the thread that submits them, they
+    // only meet the other threads by being stolen.
+    group.submit([&] {
+      for (int i = 0; i < 4; i++) {
+        group.submit([&] {
+          started++;
+          // Everyone holds on to its task until all of them run.
+          while (started < 4) {
+            std::this_thread::yield();
+          }
+          std::lock_guard<std::mutex> lk(mtx);
+          threads.insert(std::this_thread::get_id());
+        });
+      }
+    });
+    group.wait();
+    REQUIRE(threads.size() == 4);
+  }
+
+  SECTION("should finish the tasks left when it is dropped") {
+    std::atomic<size_t> done{0};
+    {
+      task_pool pool(2);
+      for (int i = 0; i < 100; i++) {
+        pool.submit([&done] { done++; });
+      }
+    }
+    REQUIRE(done == 100);
+  }
+}
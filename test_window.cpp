@@ -0,0 +1,96 @@
+#include <catch2/catch.hpp>
+#include <map>
+#include <string>
+
+#include <unistd.h>
+
+#include "stream.h"
+#include "window.h"
+
+static std::map<owned_url_t, count_t> top_of(const sliding_window &window,
+                                             size_t k) {
+  sliding_window::top_type top(k);
+  window.top(top);
+  std::map<owned_url_t, count_t> result;
+  for (const auto &e : top) {
+    result.insert({owned_url_t(e.url), e.count});
+  }
+  return result;
+}
+
+TEST_CASE("sliding_window", "[window spec]") {
+  std::hash<slice_url_t> hasher;
+  std::vector<owned_url_t> urls;
+  srand(31);
+  for (int i = 0; i < 5000; i++) {
+    urls.push_back("url-" + std::to_string(rand() % (i < 2500 ? 50 : 10)));
+  }
+
+  SECTION("should only count the panes in the window") {
+    // 4 panes of 100 lines, checked after every pane.
+    sliding_window window(4, 3);
+    for (size_t i = 0; i < urls.size(); i++) {
+      if (i > 0 && i % 100 == 0) {
+        window.roll();
+      }
+      window.add(urls[i], hasher(urls[i]));
+      if (i % 100 != 99) {
+        continue;
+      }
+      std::map<owned_url_t, count_t> counts;
+      for (size_t j = i + 1 - std::min(i + 1, (size_t)400); j <= i; j++) {
+        counts[urls[j]]++;
+      }
+      REQUIRE(window.lines() == std::min(i + 1, (size_t)400));
+      REQUIRE(top_of(window, 100) == counts);
+    }
+  }
+
+  SECTION("should tumble with one pane") {
+    sliding_window window(1, 2);
+    for (int i = 0; i < 10; i++) {
+      window.add(urls[i], hasher(urls[i]));
+    }
+    window.roll();
+    REQUIRE(window.lines() == 0);
+    REQUIRE(top_of(window, 10).empty());
+    window.add("new", hasher("new"));
+    REQUIRE(top_of(window, 10) == std::map<owned_url_t, count_t>{{"new", 1}});
+  }
+}
+
+TEST_CASE("stream_master", "[window spec]") {
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  // 30 lines fit in the pipe, the window is the last 20 of them.
+  std::string input;
+  for (int i = 0; i < 30; i++) {
+    input += i < 10 ? "old\n" : (i % 2 ? "a\n" : "b\n");
+  }
+  input += "a";
+  REQUIRE(write(fds[1], input.data(), input.size()) == (ssize_t)input.size());
+  REQUIRE(close(fds[1]) == 0);
+  FILE *output = tmpfile();
+  REQUIRE(output != NULL);
+  window_length window, slide;
+  REQUIRE(window_length::parse("20", window));
+  REQUIRE(window_length::parse("5", slide));
+  REQUIRE(!window_length::parse("5m", slide));
+  stream_master m(fds[0], window, slide, 60, 2, 2, output);
+  m.run();
+  REQUIRE(m.n_emits() == 1);
+  rewind(output);
+  char line[64];
+  REQUIRE(fgets(line, sizeof(line), output));
+  // The unfinished last line counts, and the first pane left the window.
+  size_t lines;
+  REQUIRE(sscanf(line, "# %*f %zu", &lines) == 1);
+  REQUIRE(lines == 16);
+  REQUIRE(fgets(line, sizeof(line), output));
+  REQUIRE(std::string(line) == "a 9\n");
+  REQUIRE(fgets(line, sizeof(line), output));
+  REQUIRE(std::string(line) == "b 7\n");
+  REQUIRE(!fgets(line, sizeof(line), output));
+  fclose(output);
+  close(fds[0]);
+}
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "heap.h"
+#include "iterator.h"
+#include "master.h"
+#include "memtable.h"
+#include "sst.h"
+
+/* Benchmarks every stage of the pipeline on zipf datasets made by genzipf,
+ * and prints the results as JSON, so that two builds can be compared. The
+ * datasets are cached in the data directory, the same parameters always give
+ * the same file. */
+
+#ifndef GENZIPF_PATH
+#define GENZIPF_PATH "genzipf"
+#endif
+
+struct dataset {
+  std::string name;
+  std::string path;
+  size_t lines;
+  size_t bytes;
+};
+
+struct result {
+  std::string name;
+  std::string dataset;
+  std::vector<double> seconds;
+  size_t items;
+  size_t bytes;
+  /* Calls to operator new in the last repetition */
+  size_t allocs = 0;
+};
+
+/* Every allocation of the process goes through here, so that the results
+ * tell how many allocations a stage makes per item. */
+static std::atomic<size_t> n_allocs{0};
+
+void *operator new(size_t size) {
+  n_allocs.fetch_add(1, std::memory_order_relaxed);
+  while (true) {
+    if (void *p = malloc(size == 0 ? 1 : size)) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static constexpr size_t zipf_ranks = 10000;
+static constexpr size_t zipf_seed = 1;
+
+static size_t file_size(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static size_t current_rss() {
+  size_t npage, garbage;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm || fscanf(statm, "%lu %lu", &garbage, &npage) != 2) {
+    die("Cannot read /proc/self/statm\n");
+  }
+  fclose(statm);
+  return npage * getpagesize();
+}
+
+/* Runs genzipf, and turns its ranks into urls that share a long prefix. */
+static dataset make_dataset(const std::string &dir, double alpha,
+                            size_t lines) {
+  char name[64];
+  snprintf(name, sizeof(name), "zipf-%.2f-%zu", alpha, lines);
+  dataset d{name, dir + "/" + name + ".txt", lines, 0};
+  if ((d.bytes = file_size(d.path)) > 0) {
+    return d;
+  }
+  std::string ranks = d.path + ".ranks";
+  FILE *gen = popen(GENZIPF_PATH " > /dev/null", "w");
+  if (!gen) {
+    die("Cannot run %s\n", GENZIPF_PATH);
+  }
+  // genzipf asks for: output file, seed, alpha, N, number of values
+  fprintf(gen, "%s\n%zu\n%f\n%zu\n%zu\n", ranks.c_str(), zipf_seed, alpha,
+          zipf_ranks, lines);
+  if (pclose(gen) != 0) {
+    die("%s failed\n", GENZIPF_PATH);
+  }
+  FILE *in = fopen(ranks.c_str(), "r");
+  FILE *out = fopen(d.path.c_str(), "w");
+  if (!in || !out) {
+    die("Cannot write the dataset %s\n", d.path.c_str());
+  }
+  int rank;
+  while (fscanf(in, "%d", &rank) == 1) {
+    fprintf(out, "http://www.example.com/articles/%d/index.html\n", rank);
+  }
+  fclose(in);
+  fclose(out);
+  unlink(ranks.c_str());
+  d.bytes = file_size(d.path);
+  return d;
+}
+
+static double timed(const std::function<void()> &f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+class bench {
+public:
+  bench(size_t repeats) : _repeats(repeats) {}
+
+  /* setup runs before every repetition and is not timed. */
+  void run(std::string name, const dataset &d, size_t items, size_t bytes,
+           const std::function<void()> &f,
+           const std::function<void()> &setup = [] {}) {
+    result r{std::move(name), d.name, {}, items, bytes};
+    for (size_t i = 0; i < _repeats; i++) {
+      setup();
+      size_t allocs = n_allocs;
+      r.seconds.push_back(timed(f));
+      r.allocs = n_allocs - allocs;
+    }
+    std::sort(r.seconds.begin(), r.seconds.end());
+    fprintf(stderr, "%-28s %-18s %10.4fs %10zu allocs\n", r.name.c_str(),
+            r.dataset.c_str(), r.seconds.front(), r.allocs);
+    _results.push_back(std::move(r));
+  }
+
+  void write_json(FILE *out) const {
+    fprintf(out, "{\n  \"repeats\": %zu,\n  \"compiler\": \"%s\",\n", _repeats,
+            __VERSION__);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < _results.size(); i++) {
+      const auto &r = _results[i];
+      double best = r.seconds.front(), median = r.seconds[r.seconds.size() / 2];
+      fprintf(out,
+              "    {\"name\": \"%s\", \"dataset\": \"%s\", \"min_s\": %.6f, "
+              "\"median_s\": %.6f, \"items\": %zu, \"bytes\": %zu, "
+              "\"items_per_s\": %.1f, \"bytes_per_s\": %.1f, "
+              "\"allocs\": %zu, \"allocs_per_item\": %.4f}%s\n",
+              r.name.c_str(), r.dataset.c_str(), best, median, r.items, r.bytes,
+              r.items / best, r.bytes / best, r.allocs,
+              (double)r.allocs / std::max(r.items, (size_t)1),
+              i + 1 == _results.size() ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+  }
+
+private:
+  size_t _repeats;
+  std::vector<result> _results;
+};
+
+static std::vector<std::string> read_urls(const dataset &d) {
+  std::vector<std::string> urls;
+  mapped_file input(d.path);
+  for (mapped_line_iter line(input.data(), input.data() + input.size());
+       line.valid(); ++line) {
+    urls.emplace_back(*line);
+  }
+  return urls;
+}
+
+template <typename Iter>
+static void fill(memtable &table, Iter begin, Iter end) {
+  std::hash<slice_url_t> hasher;
+  for (; begin != end; ++begin) {
+    size_t hash = hasher(*begin);
+    if (!table.increment(*begin, hash)) {
+      table.insert(*begin, hash);
+    }
+  }
+}
+
+static void bench_parse(bench &b, const dataset &d) {
+  b.run("parse/read_line_iter", d, d.lines, d.bytes, [&] {
+    FILE *input = fopen(d.path.c_str(), "r");
+    size_t n = 0;
+    for (read_line_iter line(input); line.valid(); ++line) {
+      n += (*line).size();
+    }
+    fclose(input);
+  });
+  b.run("parse/mapped_line_iter", d, d.lines, d.bytes, [&] {
+    mapped_file input(d.path);
+    size_t n = 0;
+    for (mapped_line_iter line(input.data(), input.data() + input.size());
+         line.valid(); ++line) {
+      n += line->size();
+    }
+  });
+}
+
+static void bench_memtable(bench &b, const dataset &d,
+                           const std::vector<std::string> &urls) {
+  // What on_new_url does for every url, without the flushes.
+  memtable table;
+  b.run(
+      "insert/memtable", d, urls.size(), d.bytes,
+      [&] { fill(table, urls.begin(), urls.end()); }, [&] { table.clear(); });
+  table.clear();
+  fill(table, urls.begin(), urls.end());
+  size_t n_keys = table.size();
+  std::string path = "bench-flush.sst";
+  for (const char *name : {"none", "lz", "zstd", "lz4"}) {
+    const codec *c = codec::find(name);
+    if (!c) {
+      continue;
+    }
+    // The uncompressed one keeps the name it always had.
+    std::string stage = "flush/write_sst";
+    b.run(
+        c == codec::none() ? stage : stage + "/" + name, d, n_keys, 0,
+        [&] {
+          FILE *out = fopen(path.c_str(), "wb");
+          write_sst(table.sorted(), out, c);
+          fclose(out);
+        },
+        [&] {
+          table.clear();
+          fill(table, urls.begin(), urls.end());
+        });
+  }
+  unlink(path.c_str());
+}
+
+static void bench_merge(bench &b, const dataset &d,
+                        const std::vector<std::string> &urls) {
+  for (size_t fan_in : {8, 64, 256}) {
+    // Every run counts a slice of the input, as a flush would.
+    std::vector<std::string> paths;
+    size_t per_run = (urls.size() + fan_in - 1) / fan_in;
+    size_t entries = 0, bytes = 0;
+    for (size_t i = 0; i < fan_in; i++) {
+      memtable table;
+      size_t first = std::min(urls.size(), i * per_run);
+      size_t last = std::min(urls.size(), first + per_run);
+      fill(table, urls.begin() + first, urls.begin() + last);
+      entries += table.size();
+      paths.push_back("bench-merge-" + std::to_string(i) + ".sst");
+      FILE *out = fopen(paths.back().c_str(), "wb");
+      write_sst(table.sorted(), out);
+      fclose(out);
+      bytes += file_size(paths.back());
+    }
+    auto open_runs = [&] {
+      std::vector<sst_read_iter> iters;
+      for (const auto &path : paths) {
+        iters.emplace_back(fopen(path.c_str(), "rb"));
+      }
+      return iters;
+    };
+    auto drain = [&](auto &&miter, std::vector<sst_read_iter> &iters) {
+      for (; miter.valid(); ++miter) {
+      }
+      for (auto &iter : iters) {
+        iter.close();
+      }
+    };
+    std::string suffix = "/" + std::to_string(fan_in);
+    b.run("merge/loser_tree_iter" + suffix, d, entries, bytes, [&] {
+      auto iters = open_runs();
+      drain(loser_tree_iter<sst_read_iter>(iters.begin(), iters.end()), iters);
+    });
+    // The whole of phase 2: merge, add up equal urls and keep the top 100.
+    // Apart from opening the runs, only the urls the heap takes allocate.
+    b.run("aggregate/top100" + suffix, d, entries, bytes, [&] {
+      auto iters = open_runs();
+      master::heap_type top(100);
+      key_aggregator aggregator([&](slice_url_t url, count_t count, size_t) {
+        top.add(url, count);
+      });
+      for (loser_tree_iter<sst_read_iter> miter(iters.begin(), iters.end());
+           miter.valid(); ++miter) {
+        aggregator.add(*miter.operator->());
+      }
+      aggregator.finish();
+      for (auto &iter : iters) {
+        iter.close();
+      }
+    });
+    for (const auto &path : paths) {
+      unlink(path.c_str());
+    }
+  }
+}
+
+static void bench_heap(bench &b, const dataset &d,
+                       const std::vector<std::string> &urls) {
+  b.run("heap/add", d, urls.size(), 0, [&] {
+    heap<entry<owned_url_t, false>> top(100);
+    for (size_t i = 0; i < urls.size(); i++) {
+      top.add(urls[i], (count_t)(i * 2654435761u % urls.size()));
+    }
+  });
+}
+
+static void bench_master(bench &b, const dataset &d, size_t n_threads) {
+  // Above what the process already uses, from always spilling to never.
+  for (size_t headroom : {1 << 20, 4 << 20, 64 << 20}) {
+    std::string name = "master/w+" + std::to_string(headroom >> 10) + "k";
+    b.run(name, d, d.lines, d.bytes, [&] {
+      master m(d.path, 4, current_rss() + headroom, 100, n_threads);
+      m.start();
+      m.wait_for_all_workers();
+    });
+  }
+}
+
+void usage(const char *progname) {
+  fprintf(stderr,
+          "%s [-o output.json] [-d data_dir] [-r repeats] [-j threads] [-q]\n",
+          progname);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  std::string output, dir = "bench-data";
+  size_t repeats = 3, n_threads = std::thread::hardware_concurrency();
+  bool quick = false;
+  while ((opt = getopt(argc, argv, "o:d:r:j:q")) != -1) {
+    switch (opt) {
+    case 'o':
+      output = optarg;
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'r':
+      repeats = std::max(atoi(optarg), 1);
+      break;
+    case 'j':
+      n_threads = atoi(optarg);
+      break;
+    case 'q':
+      quick = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  mkdir(dir.c_str(), 0700);
+  std::vector<dataset> datasets;
+  for (double alpha : {0.9, 1.2}) {
+    for (size_t lines : {100000, 400000}) {
+      if (!quick || lines == 100000) {
+        datasets.push_back(make_dataset(dir, alpha, lines));
+      }
+    }
+  }
+  bench b(repeats);
+  for (const auto &d : datasets) {
+    auto urls = read_urls(d);
+    bench_parse(b, d);
+    bench_memtable(b, d, urls);
+    bench_merge(b, d, urls);
+    bench_heap(b, d, urls);
+    bench_master(b, d, n_threads);
+  }
+  FILE *out = output.empty() ? stdout : fopen(output.c_str(), "w");
+  if (!out) {
+    die("Cannot write to %s\n", output.c_str());
+  }
+  b.write_json(out);
+  if (out != stdout) {
+    fclose(out);
+  }
+}
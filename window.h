@@ -0,0 +1,135 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <stddef.h>
+
+#include "entry.h"
+#include "heap.h"
+#include "memtable.h"
+#include "types.h"
+
+/* Url counts over a sliding window of a stream. The window is n_panes panes,
+ * each a fixed number of lines or seconds, and the caller rolls them. A url
+ * is only counted in the newest pane; when a pane is rolled it is added to the
+ * totals, and once it falls out of the window it is subtracted again, so
+ * nothing is ever counted twice. With one pane the window tumbles. */
+class sliding_window {
+public:
+  using top_type = heap<entry<owned_url_t, false>>;
+
+  sliding_window(size_t n_panes, size_t n_shards)
+      : _n_panes(std::max(n_panes, (size_t)1)),
+        _n_shards(std::max(n_shards, (size_t)1)), _totals(_n_shards) {
+    _panes.emplace_back(_n_shards);
+  }
+
+  void add(slice_url_t url, size_t hash) {
+    auto &table = _panes.back().tables[hash % _n_shards];
+    if (!table.increment(url, hash)) {
+      table.insert(url, hash);
+    }
+    _panes.back().lines++;
+    _lines++;
+  }
+
+  /* Starts a new pane, the oldest one leaves the window if it is full. */
+  void roll() {
+    if (_n_panes > 1) {
+      fold(_panes.back(), 1);
+    }
+    if (_panes.size() == _n_panes) {
+      if (_n_panes > 1) {
+        fold(_panes.front(), -1);
+      }
+      _lines -= _panes.front().lines;
+      _panes.pop_front();
+    }
+    _panes.emplace_back(_n_shards);
+  }
+
+  /* Adds the urls in the window to top. Only the urls top takes are
+   * copied. */
+  void top(top_type &top) const {
+    const auto &newest = _panes.back();
+    for (size_t shard = 0; shard < _n_shards; shard++) {
+      const auto &table = newest.tables[shard];
+      for (const auto &total : _totals[shard]) {
+        const auto &e = total.second;
+        top.add(slice_url_t(e.url), e.count + table.count_of(e.url, e.hash),
+                e.hash);
+      }
+      table.for_each([&](const memtable::entry_type &e) {
+        if (!find(shard, e.url, e.hash)) {
+          top.add(e.url, e.count, e.hash);
+        }
+      });
+    }
+  }
+
+  /* The lines in the window, the newest pane included */
+  size_t lines() const { return _lines; }
+
+  /* The lines in the newest pane */
+  size_t pane_lines() const { return _panes.back().lines; }
+
+  size_t n_panes() const { return _n_panes; }
+
+private:
+  struct pane {
+    std::unique_ptr<memtable[]> tables;
+    size_t lines = 0;
+
+    pane(size_t n_shards) : tables(std::make_unique<memtable[]>(n_shards)) {}
+  };
+
+  /* The urls of the panes before the newest one, keyed by hash */
+  struct total {
+    owned_url_t url;
+    count_t count;
+    size_t hash;
+  };
+  using totals_type = std::unordered_multimap<size_t, total>;
+
+  const total *find(size_t shard, slice_url_t url, size_t hash) const {
+    auto range = _totals[shard].equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.url == url) {
+        return &it->second;
+      }
+    }
+    return nullptr;
+  }
+
+  /* Adds the counts of p to the totals, or takes them off with sign -1 */
+  void fold(const pane &p, int sign) {
+    for (size_t shard = 0; shard < _n_shards; shard++) {
+      auto &totals = _totals[shard];
+      p.tables[shard].for_each([&](const memtable::entry_type &e) {
+        auto range = totals.equal_range(e.hash);
+        auto it = std::find_if(range.first, range.second, [&](const auto &t) {
+          return t.second.url == e.url;
+        });
+        if (sign > 0) {
+          if (it == range.second) {
+            totals.emplace(e.hash, total{owned_url_t(e.url), e.count, e.hash});
+          } else {
+            it->second.count += e.count;
+          }
+        } else if ((it->second.count -= e.count) == 0) {
+          totals.erase(it);
+        }
+      });
+    }
+  }
+
+  size_t _n_panes;
+  size_t _n_shards;
+  size_t _lines = 0;
+  /* The oldest pane first, the newest one takes the new urls */
+  std::deque<pane> _panes;
+  std::vector<totals_type> _totals;
+};